@@ -15,6 +15,7 @@
 #include <linux/init.h>
 #include <linux/skbuff.h>
 #include <linux/jhash.h>
+#include <linux/random.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
 #include <net/netlink.h>
@@ -38,24 +39,31 @@
  * head drops only.
  * ECN capability is on by default.
  * Low memory footprint (64 bytes per flow)
+ *
+ * Cuckoo variant: flows live in two tables, the two halves of q->flows[],
+ * and a packet hash has one slot in each. A new flow whose slots are both
+ * busy pushes the occupants along their own alternate slots; a flow is
+ * relocated as a whole, whatever its queue depth.
  */
 
+#define FQ_CODEL_CUCKOO_MAX_KICKS	16
+
 struct fq_codel_flow {
 	struct sk_buff	  *head;
 	struct sk_buff	  *tail;
 	struct list_head  flowchain;
 	int		  deficit;
 	struct codel_vars cvars;
+	u32		  hash;		/* key of the packets queued here */
 }; /* please try to keep this structure <= 64 bytes */
 
 struct fq_codel_sched_data {
 	struct tcf_proto __rcu *filter_list; /* optional external classifier */
 	struct tcf_block *block;
-	struct fq_codel_flow *flows1;	/* Flows table [flows_cnt] */
-	//$$
-	struct fq_codel_flow *flows2;
-	u32		*backlogs;	/* backlog table [flows_cnt] */
-	u32		flows_cnt;	/* number of flows */
+	struct fq_codel_flow *flows;	/* Flows table [2 * flows_cnt] */
+	u32		*backlogs;	/* backlog table [2 * flows_cnt] */
+	u32		flows_cnt;	/* number of flows per table */
+	u32		perturbation;	/* seed of the second table hash */
 	u32		quantum;	/* psched_mtu(qdisc_dev(sch)); */
 	u32		drop_batch_size;
 	u32		memory_limit;
@@ -70,11 +78,8 @@ struct fq_codel_sched_data {
 	struct list_head old_flows;	/* list of old flows */
 };
 
-static unsigned int fq_codel_hash(const struct fq_codel_sched_data *q,
-				  struct sk_buff *skb)
-{
-	return reciprocal_scale(skb_get_hash(skb), q->flows_cnt);
-}
+static unsigned int fq_codel_cuckoo_hash(struct fq_codel_sched_data *q,
+					 u32 hash);
 
 static unsigned int fq_codel_classify(struct sk_buff *skb, struct Qdisc *sch,
 				      int *qerr)
@@ -91,7 +96,7 @@ static unsigned int fq_codel_classify(struct sk_buff *skb, struct Qdisc *sch,
 
 	filter = rcu_dereference_bh(q->filter_list);
 	if (!filter)
-		return fq_codel_hash(q, skb) + 1;
+		return fq_codel_cuckoo_hash(q, skb_get_hash(skb)) + 1;
 
 	*qerr = NET_XMIT_SUCCESS | __NET_XMIT_BYPASS;
 	result = tcf_classify(skb, filter, &res, false);
@@ -154,7 +159,7 @@ static unsigned int fq_codel_drop(struct Qdisc *sch, unsigned int max_packets,
 	 * In stress mode, we'll try to drop 64 packets from the flow,
 	 * amortizing this linear lookup to one cache line per drop.
 	 */
-	for (i = 0; i < q->flows_cnt; i++) {
+	for (i = 0; i < 2 * q->flows_cnt; i++) {
 		if (q->backlogs[i] > maxbacklog) {
 			maxbacklog = q->backlogs[i];
 			idx = i;
@@ -183,203 +188,103 @@ static unsigned int fq_codel_drop(struct Qdisc *sch, unsigned int max_packets,
 	sch->q.qlen -= i;
 	return idx;
 }
-//$$
-//Function to swap contents of two flows
-static void swap (struct fq_codel_flow *f1, struct fq_codel_flow *f2){
-    struct fq_codel_flow temp = *f1;
-    *f1 = *f2;
-    *f2 = temp;
+
+/* Move a whole flow to an empty slot of the other table. Only the queue
+ * pointers, scheduling state and the list node change hands, so the cost
+ * does not depend on how many packets the flow holds; qdisc totals are
+ * unaffected.
+ */
+static void fq_codel_flow_move(struct fq_codel_sched_data *q,
+			       struct fq_codel_flow *dst,
+			       struct fq_codel_flow *src)
+{
+	/* a drained dst may still be linked: its old owner gives up that place
+	 * along with its scheduling state
+	 */
+	list_del_init(&dst->flowchain);
+	dst->head = src->head;
+	dst->tail = src->tail;
+	dst->deficit = src->deficit;
+	dst->cvars = src->cvars;
+	dst->hash = src->hash;
+	if (!list_empty(&src->flowchain))
+		list_replace_init(&src->flowchain, &dst->flowchain);
+	q->backlogs[dst - q->flows] = q->backlogs[src - q->flows];
+
+	q->backlogs[src - q->flows] = 0;
+	src->head = NULL;
+	codel_vars_init(&src->cvars);
+}
+
+/* Slot of a key in table 0 (the first flows_cnt flows) or table 1 (the
+ * next flows_cnt), as an index into q->flows[].
+ */
+static unsigned int fq_codel_cuckoo_slot(const struct fq_codel_sched_data *q,
+					 u32 hash, int table)
+{
+	if (!table)
+		return reciprocal_scale(hash, q->flows_cnt);
+	return q->flows_cnt +
+	       reciprocal_scale(jhash_1word(hash, q->perturbation), q->flows_cnt);
 }
-//$$
-//Cuckoo hash function
-static void handleCollision(struct fq_codel_flow *flow, struct Qdisc *sch){
-
-    struct fq_codel_sched_data *q = qdisc_prev(sch);
-    unsigned int idx, prev_backlog, prev_qlen,i;
-    struct sk_buff *temp_skb;
-    int uninitialized_var(ret);
-    unsigned int pkt_len;
-    bool memory_limited;
-
-    for(i=0; i< q->flows_cnt; i++){
-        //Check for slot in flows2 table
-        idx = fq_codel_classify(flow->head, sch, &ret);
-        if(q->flows2[idx]->head == NULL){
-            temp_skb = flow->head;
-            while(temp_skb != flow->tail){
-                flow_queue_add(&q->flows2[idx], temp_skb);
-                //update stats
-                q->backlogs[idx] += qdisc_pkt_len(temp_skb);
-                qdisc_qstats_backlog_inc(sch, temp_skb);
-
-                if (list_empty(&q->flows2[idx]->flowchain)) {
-                    list_add_tail(&q->flows2[idx]->flowchain, &q->new_flows);
-                    q->new_flow_count++;
-                    q->flows2[idx]->deficit = q->quantum;
-                }
-                get_codel_cb(temp_skb)->mem_usage = temp_skb->truesize;
-                q->memory_usage += get_codel_cb(temp_skb)->mem_usage;
-                memory_limited = q->memory_usage > q->memory_limit;
-                if (++sch->q.qlen <= sch->limit && !memory_limited)
-                    return NET_XMIT_SUCCESS;
-
-                prev_backlog = sch->qstats.backlog;
-                prev_qlen = sch->q.qlen;
-
-                /* save this packet length as it might be dropped by fq_codel_drop() */
-                pkt_len = qdisc_pkt_len(temp_skb);
-                /* fq_codel_drop() is quite expensive, as it performs a linear search
-                 * in q->backlogs[] to find a fat flow.
-                 * So instead of dropping a single packet, drop half of its backlog
-                 * with a 64 packets limit to not add a too big cpu spike here.
-                 */
-                ret = fq_codel_drop(sch, q->drop_batch_size, to_free);
-
-                prev_qlen -= sch->q.qlen;
-                prev_backlog -= sch->qstats.backlog;
-                q->drop_overlimit += prev_qlen;
-                if (memory_limited)
-                    q->drop_overmemory += prev_qlen;
-
-                /* As we dropped packet(s), better let upper stack know this.
-                 * If we dropped a packet for this flow, return NET_XMIT_CN,
-                 * but in this case, our parents wont increase their backlogs.
-                 */
-                if (ret == idx) {
-                    qdisc_tree_reduce_backlog(sch, prev_qlen - 1,
-                                              prev_backlog - pkt_len);
-                    return NET_XMIT_CN;
-                }
-                qdisc_tree_reduce_backlog(sch, prev_qlen, prev_backlog);
-                //update pointer
-                temp_skb = temp_skb->next;
-            }
-            //Add the last packet from flows1[idx] to flows2[idx]
-            flow_queue_add(&q->flows2[idx], flow->tail);
-            //update stats
-            q->backlogs[idx] += qdisc_pkt_len(flow->tail);
-            qdisc_qstats_backlog_inc(sch, flow->tail);
-
-            if (list_empty(&q->flows2[idx]->flowchain)) {
-                list_add_tail(&q->flows2[idx]->flowchain, &q->new_flows);
-                q->new_flow_count++;
-                q->flows2[idx]->deficit = q->quantum;
-            }
-            get_codel_cb(flow->tail)->mem_usage = flow->tail->truesize;
-            q->memory_usage += get_codel_cb(flow->tail)->mem_usage;
-            memory_limited = q->memory_usage > q->memory_limit;
-            if (++sch->q.qlen <= sch->limit && !memory_limited)
-                return NET_XMIT_SUCCESS;
-
-            prev_backlog = sch->qstats.backlog;
-            prev_qlen = sch->q.qlen;
-	    pkt_len = qdisc_pkt_len(flow->tail);
-            ret = fq_codel_drop(sch, q->drop_batch_size, to_free);
-
-            prev_qlen -= sch->q.qlen;
-            prev_backlog -= sch->qstats.backlog;
-            q->drop_overlimit += prev_qlen;
-            if (memory_limited)
-                q->drop_overmemory += prev_qlen;
-
-            if (ret == idx) {
-                qdisc_tree_reduce_backlog(sch, prev_qlen - 1,
-                                          prev_backlog - pkt_len);
-                return NET_XMIT_CN;
-            }
-            qdisc_tree_reduce_backlog(sch, prev_qlen, prev_backlog);
-            return;
-        }
-        else{
-            swap(flow, &q->flows2[idx]);
-        }
-        i++;
-
-        //Check for slot in flows1 table
-        idx = fq_codel_classify(flow->head, sch, &ret);
-        if(q->flows1[idx]->head == NULL){
-            temp_skb = flow->head;
-            while(temp_skb != flow->tail){
-                flow_queue_add(&q->flows1[idx], temp_skb);
-                //update stats
-                q->backlogs[idx] += qdisc_pkt_len(temp_skb);
-                qdisc_qstats_backlog_inc(sch, temp_skb);
-
-                if (list_empty(&q->flows2[idx]->flowchain)) {
-                    list_add_tail(&q->flows2[idx]->flowchain, &q->new_flows);
-                    q->new_flow_count++;
-                    q->flows2[idx]->deficit = q->quantum;
-                }
-                get_codel_cb(temp_skb)->mem_usage = temp_skb->truesize;
-                q->memory_usage += get_codel_cb(temp_skb)->mem_usage;
-                memory_limited = q->memory_usage > q->memory_limit;
-                if (++sch->q.qlen <= sch->limit && !memory_limited)
-                    return NET_XMIT_SUCCESS;
-
-                prev_backlog = sch->qstats.backlog;
-                prev_qlen = sch->q.qlen;
-
-                pkt_len = qdisc_pkt_len(temp_skb);
-                ret = fq_codel_drop(sch, q->drop_batch_size, to_free);
-
-                prev_qlen -= sch->q.qlen;
-                prev_backlog -= sch->qstats.backlog;
-                q->drop_overlimit += prev_qlen;
-                if (memory_limited)
-                    q->drop_overmemory += prev_qlen;
-
-                if (ret == idx) {
-                    qdisc_tree_reduce_backlog(sch, prev_qlen - 1,
-                                              prev_backlog - pkt_len);
-                    return NET_XMIT_CN;
-                }
-                qdisc_tree_reduce_backlog(sch, prev_qlen, prev_backlog);
-                //update pointer
-                temp_skb = temp_skb->next;
-            }
-            //Add the last packet from flows1[idx] to flows2[idx]
-            flow_queue_add(&q->flows1[idx], flow->tail);
-            //update stats
-            q->backlogs[idx] += qdisc_pkt_len(flow->tail);
-            qdisc_qstats_backlog_inc(sch, flow->tail);
-
-            if (list_empty(&q->flows2[idx]->flowchain)) {
-                list_add_tail(&q->flows2[idx]->flowchain, &q->new_flows);
-                q->new_flow_count++;
-                q->flows2[idx]->deficit = q->quantum;
-            }
-            get_codel_cb(flow->tail)->mem_usage = flow->tail->truesize;
-            q->memory_usage += get_codel_cb(flow->tail)->mem_usage;
-            memory_limited = q->memory_usage > q->memory_limit;
-            if (++sch->q.qlen <= sch->limit && !memory_limited)
-                return NET_XMIT_SUCCESS;
-
-            prev_backlog = sch->qstats.backlog;
-            prev_qlen = sch->q.qlen;
-
-            pkt_len = qdisc_pkt_len(flow->tail);
-            ret = fq_codel_drop(sch, q->drop_batch_size, to_free);
-
-            prev_qlen -= sch->q.qlen;
-            prev_backlog -= sch->qstats.backlog;
-            q->drop_overlimit += prev_qlen;
-            if (memory_limited)
-                q->drop_overmemory += prev_qlen;
-
-            if (ret == idx) {
-                qdisc_tree_reduce_backlog(sch, prev_qlen - 1,
-                                          prev_backlog - pkt_len);
-                return NET_XMIT_CN;
-            }
-            qdisc_tree_reduce_backlog(sch, prev_qlen, prev_backlog);
-            return;
-        }
-        else{
-            swap(flow, &q->flows1[idx]);
-        }
-    }
-    return;
+
+/* A slot is free once its flow holds no packet, even if the flow is still
+ * linked on new_flows/old_flows: the new owner simply inherits that place,
+ * as a colliding flow would in plain fq_codel.
+ */
+static bool fq_codel_slot_free(const struct fq_codel_sched_data *q,
+			       unsigned int slot)
+{
+	return !q->flows[slot].head;
 }
+
+/* Find the flow of a packet hash, making room for it if needed. A new key
+ * goes to whichever of its two slots is free; when both are taken, the
+ * displacement path is searched first and then walked backwards, moving
+ * each flow one step into the slot its successor left, so nothing is moved
+ * unless the whole path ends on a free slot. Without one, the key shares
+ * its first slot, like a plain fq_codel collision.
+ */
+static unsigned int fq_codel_cuckoo_hash(struct fq_codel_sched_data *q,
+					 u32 hash)
+{
+	unsigned int path[FQ_CODEL_CUCKOO_MAX_KICKS + 1];
+	unsigned int slot0 = fq_codel_cuckoo_slot(q, hash, 0);
+	unsigned int slot1 = fq_codel_cuckoo_slot(q, hash, 1);
+	int len;
+
+	if (!fq_codel_slot_free(q, slot0) && q->flows[slot0].hash == hash)
+		return slot0;
+	if (!fq_codel_slot_free(q, slot1) && q->flows[slot1].hash == hash)
+		return slot1;
+	if (fq_codel_slot_free(q, slot0))
+		goto claim;
+	if (fq_codel_slot_free(q, slot1)) {
+		slot0 = slot1;
+		goto claim;
+	}
+
+	path[0] = slot0;
+	for (len = 1; len <= FQ_CODEL_CUCKOO_MAX_KICKS; len++) {
+		unsigned int cur = path[len - 1];
+		u32 key = q->flows[cur].hash;
+
+		/* a flow sits in table 0 below flows_cnt */
+		path[len] = fq_codel_cuckoo_slot(q, key, cur < q->flows_cnt);
+		if (fq_codel_slot_free(q, path[len]))
+			break;
+	}
+	if (len > FQ_CODEL_CUCKOO_MAX_KICKS)
+		return slot0;
+
+	for (; len > 0; len--)
+		fq_codel_flow_move(q, &q->flows[path[len]],
+				   &q->flows[path[len - 1]]);
+claim:
+	q->flows[slot0].hash = hash;
+	return slot0;
+}
+
 static int fq_codel_enqueue(struct sk_buff *skb, struct Qdisc *sch,
 			    struct sk_buff **to_free)
 {
@@ -400,62 +305,51 @@ static int fq_codel_enqueue(struct sk_buff *skb, struct Qdisc *sch,
 	idx--;
 
 	codel_set_enqueue_time(skb);
-	//$$
-	flow = &q->flows1[idx];
-	bool isSameType = false;
-	if(flow->head != NULL && (skb_get_hash(skb) == skb_get_hash(flow->head)))
-	isSameType = true;
-
-	if(isSameType || flow->head == NULL){
-        flow_queue_add(flow, skb);
-        q->backlogs[idx] += qdisc_pkt_len(skb);
-        qdisc_qstats_backlog_inc(sch, skb);
-
-        if (list_empty(&flow->flowchain)) {
-            list_add_tail(&flow->flowchain, &q->new_flows);
-            q->new_flow_count++;
-            flow->deficit = q->quantum;
-        }
-        get_codel_cb(skb)->mem_usage = skb->truesize;
-        q->memory_usage += get_codel_cb(skb)->mem_usage;
-        memory_limited = q->memory_usage > q->memory_limit;
-        if (++sch->q.qlen <= sch->limit && !memory_limited)
-            return NET_XMIT_SUCCESS;
-
-        prev_backlog = sch->qstats.backlog;
-        prev_qlen = sch->q.qlen;
-
-        /* save this packet length as it might be dropped by fq_codel_drop() */
-        pkt_len = qdisc_pkt_len(skb);
-        /* fq_codel_drop() is quite expensive, as it performs a linear search
-         * in q->backlogs[] to find a fat flow.
-         * So instead of dropping a single packet, drop half of its backlog
-         * with a 64 packets limit to not add a too big cpu spike here.
-         */
-        ret = fq_codel_drop(sch, q->drop_batch_size, to_free);
-
-        prev_qlen -= sch->q.qlen;
-        prev_backlog -= sch->qstats.backlog;
-        q->drop_overlimit += prev_qlen;
-        if (memory_limited)
-            q->drop_overmemory += prev_qlen;
-
-        /* As we dropped packet(s), better let upper stack know this.
-         * If we dropped a packet for this flow, return NET_XMIT_CN,
-         * but in this case, our parents wont increase their backlogs.
-         */
-        if (ret == idx) {
-            qdisc_tree_reduce_backlog(sch, prev_qlen - 1,
-                                      prev_backlog - pkt_len);
-            return NET_XMIT_CN;
-        }
-        qdisc_tree_reduce_backlog(sch, prev_qlen, prev_backlog);
+	flow = &q->flows[idx];
+	flow_queue_add(flow, skb);
+	q->backlogs[idx] += qdisc_pkt_len(skb);
+	qdisc_qstats_backlog_inc(sch, skb);
+
+	if (list_empty(&flow->flowchain)) {
+		list_add_tail(&flow->flowchain, &q->new_flows);
+		q->new_flow_count++;
+		flow->deficit = q->quantum;
 	}
-	else{
-	    handleCollision(flow,sch);
-	    //delete the queue at flows1[idx], form a new queue and add the packet there
+	get_codel_cb(skb)->mem_usage = skb->truesize;
+	q->memory_usage += get_codel_cb(skb)->mem_usage;
+	memory_limited = q->memory_usage > q->memory_limit;
+	if (++sch->q.qlen <= sch->limit && !memory_limited)
+		return NET_XMIT_SUCCESS;
+
+	prev_backlog = sch->qstats.backlog;
+	prev_qlen = sch->q.qlen;
+
+	/* save this packet length as it might be dropped by fq_codel_drop() */
+	pkt_len = qdisc_pkt_len(skb);
+	/* fq_codel_drop() is quite expensive, as it performs a linear search
+	 * in q->backlogs[] to find a fat flow.
+	 * So instead of dropping a single packet, drop half of its backlog
+	 * with a 64 packets limit to not add a too big cpu spike here.
+	 */
+	ret = fq_codel_drop(sch, q->drop_batch_size, to_free);
+
+	prev_qlen -= sch->q.qlen;
+	prev_backlog -= sch->qstats.backlog;
+	q->drop_overlimit += prev_qlen;
+	if (memory_limited)
+		q->drop_overmemory += prev_qlen;
+
+	/* As we dropped packet(s), better let upper stack know this.
+	 * If we dropped a packet for this flow, return NET_XMIT_CN,
+	 * but in this case, our parents wont increase their backlogs.
+	 */
+	if (ret == idx) {
+		qdisc_tree_reduce_backlog(sch, prev_qlen - 1,
+					  prev_backlog - pkt_len);
+		return NET_XMIT_CN;
 	}
-    return NET_XMIT_SUCCESS;
+	qdisc_tree_reduce_backlog(sch, prev_qlen, prev_backlog);
+	return NET_XMIT_SUCCESS;
 }
 
 /* This is the specific function called from codel_dequeue()
@@ -549,14 +443,14 @@ static void fq_codel_reset(struct Qdisc *sch)
 
 	INIT_LIST_HEAD(&q->new_flows);
 	INIT_LIST_HEAD(&q->old_flows);
-	for (i = 0; i < q->flows_cnt; i++) {
+	for (i = 0; i < 2 * q->flows_cnt; i++) {
 		struct fq_codel_flow *flow = q->flows + i;
 
 		fq_codel_flow_purge(flow);
 		INIT_LIST_HEAD(&flow->flowchain);
 		codel_vars_init(&flow->cvars);
 	}
-	memset(q->backlogs, 0, q->flows_cnt * sizeof(u32));
+	memset(q->backlogs, 0, 2 * q->flows_cnt * sizeof(u32));
 	sch->q.qlen = 0;
 	sch->qstats.backlog = 0;
 	q->memory_usage = 0;
@@ -686,19 +580,20 @@ static int fq_codel_init(struct Qdisc *sch, struct nlattr *opt,
 		goto init_failure;
 
 	if (!q->flows) {
-		q->flows = kvcalloc(q->flows_cnt,
+		q->flows = kvcalloc(2 * q->flows_cnt,
 				    sizeof(struct fq_codel_flow),
 				    GFP_KERNEL);
 		if (!q->flows) {
 			err = -ENOMEM;
 			goto init_failure;
 		}
-		q->backlogs = kvcalloc(q->flows_cnt, sizeof(u32), GFP_KERNEL);
+		q->backlogs = kvcalloc(2 * q->flows_cnt, sizeof(u32), GFP_KERNEL);
 		if (!q->backlogs) {
 			err = -ENOMEM;
 			goto alloc_failure;
 		}
-		for (i = 0; i < q->flows_cnt; i++) {
+		q->perturbation = get_random_u32();
+		for (i = 0; i < 2 * q->flows_cnt; i++) {
 			struct fq_codel_flow *flow = q->flows + i;
 
 			INIT_LIST_HEAD(&flow->flowchain);
@@ -829,7 +724,7 @@ static int fq_codel_dump_class_stats(struct Qdisc *sch, unsigned long cl,
 	struct gnet_stats_queue qs = { 0 };
 	struct tc_fq_codel_xstats xstats;
 
-	if (idx < q->flows_cnt) {
+	if (idx < 2 * q->flows_cnt) {
 		const struct fq_codel_flow *flow = &q->flows[idx];
 		const struct sk_buff *skb;
 
@@ -863,7 +758,7 @@ static int fq_codel_dump_class_stats(struct Qdisc *sch, unsigned long cl,
 	}
 	if (gnet_stats_copy_queue(d, NULL, &qs, qs.qlen) < 0)
 		return -1;
-	if (idx < q->flows_cnt)
+	if (idx < 2 * q->flows_cnt)
 		return gnet_stats_copy_app(d, &xstats, sizeof(xstats));
 	return 0;
 }
@@ -876,7 +771,7 @@ static void fq_codel_walk(struct Qdisc *sch, struct qdisc_walker *arg)
 	if (arg->stop)
 		return;
 
-	for (i = 0; i < q->flows_cnt; i++) {
+	for (i = 0; i < 2 * q->flows_cnt; i++) {
 		if (list_empty(&q->flows[i].flowchain) ||
 		    arg->count < arg->skip) {
 			arg->count++;
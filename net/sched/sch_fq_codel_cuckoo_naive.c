@@ -14,14 +14,24 @@
 #include <linux/errno.h>
 #include <linux/init.h>
 #include <linux/skbuff.h>
+#include <linux/rbtree.h>
+#include <linux/random.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/jhash.h>
+#include <linux/hash.h>
+#include <linux/bitmap.h>
 #include <net/netlink.h>
 #include <net/pkt_sched.h>
 #include <net/pkt_cls.h>
 #include <net/codel.h>
 #include <net/codel_impl.h>
 #include <net/codel_qdisc.h>
+#include <net/dsfield.h>
+#include <net/inet_ecn.h>
+#include <net/tcp.h>
 
 /*	Fair Queue CoDel.
  *
@@ -36,295 +46,1991 @@
  * For a given flow, packets are not reordered (CoDel uses a FIFO)
  * head drops only.
  * ECN capability is on by default.
- * Low memory footprint (64 bytes per flow)
+ * Low memory footprint (about 152 bytes per flow on 64-bit, the DRR and
+ * CoDel state in its first 64)
+ *
+ * Optionally (TCA_FQ_CODEL_BLUE), each flow also carries a BLUE drop
+ * probability, as in COBALT: it ramps up every time the flow is found to be
+ * the one overflowing the qdisc and decays when its queue runs empty.
+ * Unresponsive flows then get dropped at enqueue, before they can fill the
+ * qdisc and force the fat flow scan in fq_codel_drop().
+ *
+ * With TCA_FQ_CODEL_L4S_THRESHOLD, packets carrying ECT(1) (or already CE)
+ * are scalable (L4S) traffic: they skip the CoDel control law and are CE
+ * marked as soon as their own sojourn time exceeds the shallow threshold.
+ * Classic traffic keeps CoDel, and flow isolation keeps both apart.
+ *
+ * While backlogged, the dequeue rate is the rate of the bottleneck we sit
+ * in front of. It is estimated when some option needs it: below
+ * TCA_FQ_CODEL_SPLIT_GSO_RATE, GSO packets are segmented at enqueue so that
+ * a 64KB super packet does not run a flow's deficit far below -quantum.
+ * With TCA_FQ_CODEL_QUANTUM_AUTO, the quantum follows the same estimate:
+ * small on slow links for latency, large on fast ones so that DRR loops
+ * less often in fq_codel_dequeue().
+ *
+ * The optional ACK filter (TCA_FQ_CODEL_ACK_FILTER) lets a new pure TCP ACK
+ * take the place of the oldest queued pure ACK of the same connection that
+ * it supersedes, so asymmetric links do not queue long runs of ACKs.
+ *
+ * Per flow caps on backlog bytes and on truesize (TCA_FQ_CODEL_FLOW_*_LIMIT)
+ * are checked at enqueue: a flow going over them is trimmed from its own
+ * head, without scanning for the fat flow.
+ *
+ * When the whole qdisc overflows, TCA_FQ_CODEL_DROP_POLICY selects the
+ * victim of fq_codel_drop(): the flow with the most backlog bytes (the
+ * default), the one whose head packet is oldest, or the largest product of
+ * both. Each flow keeps the enqueue time of its head packet for that, so
+ * the scan never touches the queued skbs.
+ *
+ * Every flow also keeps a byte and packet rate estimate, sampled at dequeue
+ * over FQ_CODEL_FLOW_RATE_WINDOW and smoothed by a 1/8 EWMA, with no timer.
+ * It is reported in the class xstats and the rate drop policy drops from
+ * the fastest backlogged flow.
+ *
+ * TCA_FQ_CODEL_PACING honours the earliest departure time that modern TCP
+ * stacks put in skb->tstamp: a flow whose head packet is not due yet leaves
+ * the DRR lists and waits in a time ordered rbtree, and the qdisc watchdog
+ * fires when the first one becomes eligible. CoDel then measures sojourn
+ * times from the departure time.
+ *
+ * TCA_FQ_CODEL_DIFFSERV splits the DRR into 3 or 4 tins picked from the DSCP
+ * of the packet that activates a flow (bulk, best effort, [video,] voice).
+ * Every tin has its own new/old flow lists while the flow table and its
+ * index stay shared. Tins are served in priority order as long as they have
+ * deficit left, and they are credited a weighted quantum each tin round, so
+ * voice gets low latency but cannot starve the others.
+ *
+ * TCA_FQ_CODEL_RATE turns on a built-in shaper, so the queue builds here
+ * rather than in a device buffer without an htb/tbf parent. Every packet
+ * advances a virtual clock by its serialization time at that rate, with
+ * TCA_FQ_CODEL_OVERHEAD bytes of link layer framing added, and dequeue
+ * waits on the watchdog while the clock runs ahead of real time. The
+ * configured rate also replaces the dequeue rate estimate.
+ *
+ * Packets are mapped to flows by a flow index selected at init with
+ * TCA_FQ_CODEL_INDEX: the original stochastic hash, or a cuckoo, hopscotch
+ * or robin hood table of TCA_FQ_CODEL_INDEX_SLOTS slots that maps each
+ * packet hash to its own flow taken from a free pool. Table backends give
+ * the flow back to the pool when it drains, so the scheduler code above
+ * them is the same whatever the index.
+ *
+ * Since a drained flow gives its mapping back, a bulk flow that pauses
+ * would come back through new_flows every time. With TCA_FQ_CODEL_BLOOM,
+ * flows that used up their first quantum are recorded in a pair of Bloom
+ * filters rotated every period, and a flow found there on activation
+ * starts in old_flows instead.
+ *
+ * With TCA_FQ_CODEL_WEIGHTS, a filter result whose major is not our handle
+ * carries a DRR weight in it: classid W:N puts the packet in flow N with a
+ * quantum W times the configured one (1 to 255), so a cls_bpf program or a
+ * u32/flower table can give subscribers unequal shares.
+ */
+
+/* Netlink attributes understood by this qdisc on top of the uapi
+ * TCA_FQ_CODEL_* set. They are numbered right after it.
+ */
+enum {
+	TCA_FQ_CODEL_BLUE = __TCA_FQ_CODEL_MAX,
+	TCA_FQ_CODEL_L4S_THRESHOLD,
+	TCA_FQ_CODEL_CUCKOO_PAD,
+	TCA_FQ_CODEL_SPLIT_GSO_RATE,
+	TCA_FQ_CODEL_ACK_FILTER,
+	TCA_FQ_CODEL_FLOW_BACKLOG_LIMIT,
+	TCA_FQ_CODEL_FLOW_MEMORY_LIMIT,
+	TCA_FQ_CODEL_QUANTUM_AUTO,
+	TCA_FQ_CODEL_PACING,
+	TCA_FQ_CODEL_DIFFSERV,
+	TCA_FQ_CODEL_RATE,
+	TCA_FQ_CODEL_OVERHEAD,
+	TCA_FQ_CODEL_INDEX,
+	TCA_FQ_CODEL_INDEX_SLOTS,
+	TCA_FQ_CODEL_EXHAUST_POLICY,
+	TCA_FQ_CODEL_OVERFLOW_FLOWS,
+	TCA_FQ_CODEL_NEW_FLOW_RATE,
+	TCA_FQ_CODEL_NEW_FLOW_BURST,
+	TCA_FQ_CODEL_BLOOM,
+	TCA_FQ_CODEL_CLASSID_INDEX,
+	TCA_FQ_CODEL_WEIGHTS,
+	TCA_FQ_CODEL_DROP_POLICY,
+	__TCA_FQ_CODEL_CUCKOO_MAX
+};
+
+#define TCA_FQ_CODEL_CUCKOO_MAX	(__TCA_FQ_CODEL_CUCKOO_MAX - 1)
+
+/* Class xstats: the uapi fq_codel class block followed by our per flow
+ * state.
+ */
+struct fq_codel_cuckoo_cl_xstats {
+	struct tc_fq_codel_xstats fq_codel;
+	__u32	rate_bps;	/* EWMA byte rate (bytes/sec) */
+	__u32	rate_pps;	/* EWMA packet rate */
+	__u32	weight;		/* DRR quantum multiplier */
+	__u32	tin;
+};
+
+/* Qdisc xstats: the uapi fq_codel block followed by the counters added by
+ * this qdisc. tc only decodes the leading uapi part, so the trailer does
+ * not break existing userspace.
+ */
+struct fq_codel_cuckoo_xstats {
+	struct tc_fq_codel_xstats fq_codel;
+	__u32	drop_blue;	/* packets dropped at enqueue by BLUE */
+	__u32	l4s_packets;	/* ECT(1)/CE packets dequeued */
+	__u32	l4s_ce_mark;	/* ... of which CE marked by l4s_threshold */
+	__u32	classic_packets; /* packets dequeued through CoDel */
+	__u32	gso_split;	/* GSO packets segmented at enqueue */
+	__u32	ack_drops;	/* pure ACKs replaced by a newer one */
+	__u32	drop_flow_limit; /* packets dropped by the per flow caps */
+	__u32	throttled_flows; /* flows currently waiting for their EDT */
+	__u32	flows_throttled; /* times a flow had to wait for its EDT */
+	__u32	tin_packets[4];	/* packets dequeued per tin, bulk first */
+	__u32	index;		/* FQ_CODEL_INDEX_* backend */
+	__u32	index_slots;
+	__u32	index_mapped;	/* flows currently owned by a key */
+	__u32	index_moves;	/* entries displaced by inserts */
+	__u32	index_failures;	/* keys that found no flow or slot */
+	__u32	exhaust_share;	/* ... then shared a candidate flow */
+	__u32	exhaust_evict;	/* ... then took a candidate flow over */
+	__u32	exhaust_overflow; /* ... then went to the overflow region */
+	__u32	exhaust_hashed;	/* ... then, with no candidate, was hashed */
+	__u32	new_flow_throttled; /* new keys over the insert rate */
+	__u32	bloom_denied;	/* activations sent to old_flows */
+	__u64	link_rate;	/* estimated bottleneck rate (bytes/sec) */
+};
+
+/* Minimum duration of one link rate sample */
+#define FQ_CODEL_RATE_WINDOW	(10 * NSEC_PER_MSEC)
+
+/* Minimum duration of one per flow rate sample, in codel time */
+#define FQ_CODEL_FLOW_RATE_WINDOW	MS2TIME(10)
+
+/* Auto quantum is 1/4096 s (244us) worth of bytes at the link rate */
+#define FQ_CODEL_QUANTUM_AUTO_SHIFT	12
+#define FQ_CODEL_QUANTUM_MIN		256
+#define FQ_CODEL_QUANTUM_MAX		(64 << 10)
+
+/* Shaper: lowest rate honoured, and how far the clock may lag behind now */
+#define FQ_CODEL_SHAPER_MIN_RATE	64
+#define FQ_CODEL_SHAPER_BURST		NSEC_PER_MSEC
+
+/* Departure times further away than this are not trusted for pacing */
+#define FQ_CODEL_PACING_HORIZON	(10ULL * NSEC_PER_SEC)
+
+/* Diffserv tins, lowest priority first; weights are in 1/16th of quantum */
+#define FQ_CODEL_MAX_TINS		4
+#define FQ_CODEL_TIN_WEIGHT_SHIFT	4
+
+static const u8 fq_codel_tin_weight[FQ_CODEL_MAX_TINS + 1][FQ_CODEL_MAX_TINS] = {
+	[1] = { 16 },			/* best effort */
+	[3] = { 1, 16, 4 },		/* bulk, best effort, voice */
+	[4] = { 1, 16, 8, 4 },		/* bulk, best effort, video, voice */
+};
+
+enum {
+	FQ_CODEL_INDEX_STOCHASTIC,
+	FQ_CODEL_INDEX_CUCKOO,
+	FQ_CODEL_INDEX_HOPSCOTCH,
+	FQ_CODEL_INDEX_ROBIN_HOOD,
+	FQ_CODEL_INDEX_MAX
+};
+
+/* Bloom filters of recently demoted flows: 2 bits per key in 16 bits per
+ * flow, at least 4096. Even with every flow demoted within a period, fewer
+ * than 3% of new keys are then falsely denied the new flow boost.
  */
+#define FQ_CODEL_BLOOM_FLOW_SHIFT	4
+#define FQ_CODEL_BLOOM_MIN_SHIFT	12
+
+/* What a table backend does with a new key when it has no flow for it */
+enum {
+	FQ_CODEL_EXHAUST_SHARE,		/* join the least backlogged candidate */
+	FQ_CODEL_EXHAUST_EVICT,		/* take over an idle candidate */
+	FQ_CODEL_EXHAUST_OVERFLOW,	/* stochastic flow of the overflow region */
+	FQ_CODEL_EXHAUST_MAX
+};
+
+/* Victim of fq_codel_drop() when the qdisc is over its limits */
+enum {
+	FQ_CODEL_DROP_BYTES,		/* most backlog bytes */
+	FQ_CODEL_DROP_SOJOURN,		/* oldest head packet */
+	FQ_CODEL_DROP_WEIGHTED,		/* largest bytes x head age */
+	FQ_CODEL_DROP_RATE,		/* highest byte rate, then backlog */
+	FQ_CODEL_DROP_MAX
+};
+
+#define FQ_CODEL_INDEX_CANDIDATES	32
+#define FQ_CODEL_NEW_FLOW_BURST		64
+/* overflow region of the overflow policy when not sized explicitly */
+#define FQ_CODEL_OVERFLOW_SHIFT		4
+
+/* Cuckoo buckets: 8 slots whose 8 bit tags fill a u64 */
+#define FQ_CODEL_CUCKOO_WAYS		8
+#define FQ_CODEL_CUCKOO_ONES		0x0101010101010101ULL
+#define FQ_CODEL_CUCKOO_MAX_KICKS	32
+
+/* Table backends get this many slots per flow unless told otherwise */
+#define FQ_CODEL_INDEX_LOAD		2
+#define FQ_CODEL_INDEX_MIN_SLOTS	64
+#define FQ_CODEL_INDEX_MAX_SLOTS	(1U << 20)
+#define FQ_CODEL_MAX_FLOWS	(FQ_CODEL_INDEX_MAX_SLOTS / FQ_CODEL_INDEX_LOAD)
+
+/* BLUE probability steps, as fractions of 2^32 (same values as COBALT) */
+#define FQ_CODEL_BLUE_INC	(1U << 24)
+#define FQ_CODEL_BLUE_DEC	(1U << 20)
 
 struct fq_codel_flow {
+	/* DRR and CoDel state, used for every packet: first cache line */
 	struct sk_buff	  *head;
 	struct sk_buff	  *tail;
 	struct list_head  flowchain;
 	int		  deficit;
+	u32		  mem_usage;	/* truesize of queued packets */
 	struct codel_vars cvars;
-}; /* please try to keep this structure <= 64 bytes */
+
+	u32		  hash;		/* key that owns this flow in the index */
+	u8		  tin;		/* tin whose lists hold flowchain */
+	u8		  weight;	/* quantum multiplier, at least 1 */
+	u32		  blue_prob;	/* BLUE drop probability (x 2^-32) */
+	codel_time_t	  blue_time;	/* last blue_prob update */
+	codel_time_t	  head_time;	/* enqueue time of head */
+	u64		  time_next_packet; /* EDT of the head packet */
+	struct sk_buff	  *ack_prev;	/* last packet before trailing ACKs */
+	struct rb_node	  rate_node;	/* in q->delayed while throttled */
+
+	/* rate estimator, see fq_codel_flow_rate_update() */
+	codel_time_t	  rate_stamp;	/* start of rate sample, 0: none */
+	u32		  rate_bytes;	/* bytes sent in rate sample */
+	u32		  rate_packets;	/* packets sent in rate sample */
+	u32		  rate_bps;	/* EWMA byte rate (bytes/sec) */
+	u32		  rate_pps;	/* EWMA packet rate */
+}; /* keep the DRR and CoDel state within the first 64 bytes */
+
+struct fq_codel_tin {
+	struct list_head new_flows;	/* list of new flows */
+	struct list_head old_flows;	/* list of old flows */
+	int		 deficit;	/* bytes left in this tin round */
+	u32		 quantum;	/* weighted share of q->quantum */
+	u32		 packets;	/* packets dequeued */
+};
+
+struct fq_codel_sched_data;
+
+struct fq_codel_index_stats {
+	u32		slots;
+};
+
+/* Flow index backend. lookup_or_insert() returns a 1-based flow number for
+ * a packet hash and release() is called when that flow drains. Backends
+ * built on q->index[] implement the last three hooks and share the rest.
+ */
+struct fq_codel_index_ops {
+	/* slot count granularity, 0 for no table, and the per slot arrays
+	 * used next to q->index
+	 */
+	u32		slot_align;
+	bool		aux;
+	bool		tags;
+
+	void		(*reset)(struct fq_codel_sched_data *q);
+	unsigned int	(*lookup_or_insert)(struct fq_codel_sched_data *q,
+					    u32 hash);
+	void		(*release)(struct fq_codel_sched_data *q,
+				   unsigned int idx);
+	int		(*resize)(struct Qdisc *sch, u32 slots);
+	void		(*stats)(const struct fq_codel_sched_data *q,
+				 struct fq_codel_index_stats *st);
+
+	unsigned int	(*lookup)(struct fq_codel_sched_data *q, u32 hash);
+	bool		(*insert)(struct fq_codel_sched_data *q,
+				  unsigned int idx);
+	void		(*remove)(struct fq_codel_sched_data *q,
+				  unsigned int idx);
+	/* occupied entries a key's probe visits, at most
+	 * FQ_CODEL_INDEX_CANDIDATES
+	 */
+	unsigned int	(*candidates)(struct fq_codel_sched_data *q, u32 hash,
+				      u32 *cand);
+};
 
 struct fq_codel_sched_data {
 	struct tcf_proto __rcu *filter_list; /* optional external classifier */
 	struct tcf_block *block;
 	struct fq_codel_flow *flows;	/* Flows table [flows_cnt] */
-	// $$
-	u16     *hashtable;      /* The hashtable holding the indexes into the flow table */
-	u32		*random_seed;	/* Array of size 2 that will hold 2 random seeds for hash1 and hash2 */
+	void		*arena;		/* flows, backlogs, mask and index */
+	void		*index_mem;	/* resized index, NULL: in the arena */
+	const struct fq_codel_index_ops *index_ops;
+	void		*index;		/* 1-based flow numbers [index_slots] */
+	u32		*index_aux;	/* per slot backend data, or NULL */
+	u8		*index_tags;	/* cuckoo key tags [index_slots] */
+	unsigned long	*empty_flow_mask; /* free flows [flows_cnt] */
+	u32		index_type;	/* FQ_CODEL_INDEX_* */
+	u32		index_slots;
+	u8		index_width;	/* bytes per q->index entry */
+	u32		index_range;	/* hash range: buckets or slots */
+	u8		index_shift;	/* index_range as 2^(32 - shift), 0: not */
+	u8		flows_shift;	/* same for flows_cnt */
+	bool		npow2;		/* holds a fq_codel_npow2 reference */
+	u32		index_seed[2];
+	u32		classid_seed;
+	bool		classid_index;	/* map class ids through the index */
+	bool		weights;	/* filter class majors are DRR weights */
+	u32		index_mapped;
+	u32		index_moves;
+	u32		index_failures;
+	u32		exhaust_policy;	/* FQ_CODEL_EXHAUST_* */
+	u32		drop_policy;	/* FQ_CODEL_DROP_* */
+	u32		overflow_cnt;	/* flows reserved at the end of flows[] */
+	u32		exhaust_share;
+	u32		exhaust_evict;
+	u32		exhaust_overflow;
+	u32		exhaust_hashed;
+	u32		new_flow_rate;	/* index inserts per second, 0: no limit */
+	u32		new_flow_burst;
+	u32		new_flow_throttled;
+	codel_time_t	bloom_period;	/* 0: no Bloom filters */
+	codel_time_t	bloom_stamp;	/* last rotation */
+	u32		bloom_cur;	/* filter being filled */
+	u32		bloom_denied;
+	u32		bloom_shift;	/* log2 of bits per filter */
+	unsigned long	*bloom[2];	/* in the arena */
+	u64		new_flow_tokens;
+	u64		new_flow_stamp;
 	u32		*backlogs;	/* backlog table [flows_cnt] */
 	u32		flows_cnt;	/* number of flows */
 	u32		quantum;	/* psched_mtu(qdisc_dev(sch)); */
 	u32		drop_batch_size;
 	u32		memory_limit;
+	u32		flow_backlog_limit; /* per flow, in bytes (0: none) */
+	u32		flow_memory_limit;  /* per flow, in truesize (0: none) */
 	struct codel_params cparams;
 	struct codel_stats cstats;
+	bool		blue;		/* per flow BLUE enabled */
+	bool		ack_filter;	/* replace superseded pure ACKs */
+	bool		quantum_auto;	/* derive quantum from link_rate */
+	bool		pacing;		/* honour skb->tstamp departure times */
+	codel_time_t	l4s_threshold;	/* L4S CE marking sojourn threshold */
+	u64		split_gso_rate;	/* segment GSO below this rate */
+	u64		link_rate;	/* estimated bottleneck rate (bytes/sec) */
+	u64		rate_stamp;	/* start of current rate sample, 0: idle */
+	u64		rate_bytes;	/* bytes sent in current rate sample */
+	u64		shaper_rate;	/* bytes/sec, 0: no shaping */
+	u64		shaper_rate_ns;	/* ns per byte << shaper_rate_shift */
+	u64		time_next_packet; /* shaper virtual clock */
+	u8		shaper_rate_shift;
+	s32		shaper_overhead; /* bytes added per packet */
 	u32		memory_usage;
 	u32		drop_overmemory;
 	u32		drop_overlimit;
+	u32		drop_blue;
+	u32		l4s_packets;
+	u32		l4s_ce_mark;
+	u32		classic_packets;
+	u32		gso_split;
+	u32		ack_drops;
+	u32		drop_flow_limit;
+	u32		throttled_flows;
+	u32		flows_throttled;
 	u32		new_flow_count;
 
-	struct list_head new_flows;	/* list of new flows */
-	struct list_head old_flows;	/* list of old flows */
+	u32		tin_cnt;	/* 1, 3 or 4 */
+	struct fq_codel_tin tins[FQ_CODEL_MAX_TINS];
+
+	struct rb_root	delayed;	/* flows waiting for their EDT */
+	u64		time_next_delayed_flow;
+	struct qdisc_watchdog watchdog;
 };
 
-// $$
-/*
- * This function simply gives you the empty flow.
- * It does not flip the bit to mark it as non-empty.
- * A separate function handles the bit flip
- * It is 0-indexed
+static bool fq_codel_flow_is_throttled(const struct fq_codel_flow *flow)
+{
+	return !RB_EMPTY_NODE(&flow->rate_node);
+}
+
+static u32 fq_codel_flow_quantum(const struct fq_codel_sched_data *q,
+				 const struct fq_codel_flow *flow)
+{
+	return q->quantum * flow->weight;
+}
+
+/* Free flows have their bit set in empty_flow_mask. Flows picked directly
+ * by a classid never go through the index, so a free flow that is busy
+ * anyway is passed over. The overflow region at the end of the table is
+ * not part of the pool. Returns flows_cnt when the pool is exhausted.
  */
 static unsigned int get_next_empty_flow(const struct fq_codel_sched_data *q)
 {
-	int i;
-	for(i=0;i<q->flows_cnt;i++)
-	{
-		if(q->flows[i].head==NULL)
-		{
-			return i;
-		}
+	unsigned int idx, pool = q->flows_cnt - q->overflow_cnt;
+
+	for_each_set_bit(idx, q->empty_flow_mask, pool) {
+		const struct fq_codel_flow *flow = &q->flows[idx];
+
+		if (!flow->head && list_empty(&flow->flowchain) &&
+		    !fq_codel_flow_is_throttled(flow))
+			return idx;
 	}
-	return 0;
+	return q->flows_cnt;
 }
 
-static unsigned int fq_codel_hash(const struct fq_codel_sched_data *q,
-				  struct sk_buff *skb)
+/* Stochastic flow of the overflow region */
+static unsigned int fq_codel_overflow_flow(const struct fq_codel_sched_data *q,
+					   u32 hash)
+{
+	return q->flows_cnt - q->overflow_cnt +
+	       reciprocal_scale(hash, q->overflow_cnt);
+}
+
+static void fq_codel_flow_rate_reset(struct fq_codel_flow *flow)
 {
-	return reciprocal_scale(skb_get_hash(skb), q->flows_cnt);
+	flow->rate_stamp = 0;
+	flow->rate_bps = 0;
+	flow->rate_pps = 0;
 }
 
-// $$
-static unsigned int fq_codel_hash_modified(const struct fq_codel_sched_data *q,
-                                  struct sk_buff *skb, int table_num)
+/* No packet queued and not scheduled: nothing depends on who owns it */
+static bool fq_codel_flow_idle(const struct fq_codel_flow *flow)
 {
-    return q->flows_cnt*table_num + reciprocal_scale(skb_get_hash_perturb(skb,q->random_seed[table_num]), q->flows_cnt);
+	return !flow->head && list_empty(&flow->flowchain) &&
+	       !fq_codel_flow_is_throttled(flow);
 }
 
-// $$
-static void cuckoo_rehash(const struct fq_codel_sched_data *q,
-                   struct sk_buff *skb, int value_to_insert)
+/* An idle flow keeps its key while it holds a BLUE probability, until the
+ * time BLUE would have taken to decay it to 0 has passed.
+ */
+static bool fq_codel_blue_expired(const struct fq_codel_sched_data *q,
+				  const struct fq_codel_flow *flow)
 {
-    int temp_index,i;
-    for(i=0;i<(q->flows_cnt);i++){
+	s32 idle = (s32)(codel_get_time() - flow->blue_time);
+	u64 steps = DIV_ROUND_UP((u64)flow->blue_prob, FQ_CODEL_BLUE_DEC);
 
-        temp_index = fq_codel_hash_modified(q,skb,0);
-        if(q->hashtable[temp_index]==0){
-            q->hashtable[temp_index]=value_to_insert;
-            return;
-        }
-        else
-            swap(value_to_insert,q->hashtable[temp_index]);
+	return idle < 0 || idle >= steps * q->cparams.target;
+}
 
-        //No. of iterations increased by 1
-        i++;
-        if(i>=(q->flows_cnt))
-            break;
+static bool fq_codel_flow_mapped(const struct fq_codel_sched_data *q,
+				 unsigned int idx)
+{
+	return !test_bit(idx, q->empty_flow_mask);
+}
 
-        skb = (q->flows[value_to_insert-1].head);
-		if(skb==NULL)
-			return;
-        temp_index = fq_codel_hash_modified(q,skb,1);
-        if(q->hashtable[temp_index]==0){
-            q->hashtable[temp_index]=value_to_insert;
-            return;
-        }
-        else
-            swap(value_to_insert,q->hashtable[temp_index]);
-
-        skb = (q->flows[value_to_insert-1].head);
-		if(skb==NULL)
-			return;
-    }
+/* A flow changing key starts over: what it learnt was about the old one */
+static void fq_codel_flow_set_key(struct fq_codel_flow *flow, u32 hash)
+{
+	list_del_init(&flow->flowchain);
+	flow->deficit = 0;
+	flow->hash = hash;
+	flow->blue_prob = 0;
+	codel_vars_init(&flow->cvars);
+	fq_codel_flow_rate_reset(flow);
+}
+
+/* Byte rate estimate of flow idx, then its backlog: a flow remapped or
+ * backlogged for less than FQ_CODEL_RATE_WINDOW has no estimate yet, and
+ * ranks by what it queues.
+ */
+static u64 fq_codel_flow_load(const struct fq_codel_sched_data *q,
+			      unsigned int idx)
+{
+	return (u64)q->flows[idx].rate_bps << 32 | q->backlogs[idx];
 }
 
-// $$
-static unsigned int fq_codel_cuckoo_hash(const struct fq_codel_sched_data *q,
-                                         struct sk_buff *skb)
+/* Take flow idx out of the pool for a new key */
+static void fq_codel_flow_map(struct fq_codel_sched_data *q, unsigned int idx,
+			      u32 hash)
 {
-    /*
-     * First calculate the hash1 and hash2 values.
-     */
-    unsigned int hash1 = fq_codel_hash_modified(q,skb,0);
-    unsigned int hash2 = fq_codel_hash_modified(q,skb,1);
+	__clear_bit(idx, q->empty_flow_mask);
+	q->index_mapped++;
+	fq_codel_flow_set_key(&q->flows[idx], hash);
+}
 
-    int idx, idx2;
+static void fq_codel_flow_unmap(struct fq_codel_sched_data *q,
+				unsigned int idx)
+{
+	__set_bit(idx, q->empty_flow_mask);
+	q->index_mapped--;
+}
 
-    if(q->hashtable[hash1]==0 && q->hashtable[hash2]==0)
-    {
-        q->hashtable[hash1] = get_next_empty_flow(q) + 1;
-        return q->hashtable[hash1];
-    }
+/* Instances whose flow count or index range is not a power of two hold a
+ * reference on this key. Until one exists, hashing is a shift and slot
+ * wrapping a mask, without even looking at the instance.
+ */
+static DEFINE_STATIC_KEY_FALSE(fq_codel_npow2);
 
-    if(q->hashtable[hash1] != 0 && q->hashtable[hash2]==0)
-    {
-        idx = q->hashtable[hash1] - 1;
+/* reciprocal_scale() by n == 2^(32 - shift) is a shift; 0 if n is not */
+static u8 fq_codel_pow2_shift(u32 n)
+{
+	return is_power_of_2(n) ? 32 - ilog2(n) : 0;
+}
 
-		if(q->flows[idx].head==NULL)
-			return q->hashtable[hash1];
+static u32 fq_codel_scale(u32 hash, u32 n, u8 shift)
+{
+	if (static_branch_unlikely(&fq_codel_npow2) && !shift)
+		return reciprocal_scale(hash, n);
+	return (u64)hash >> shift;
+}
 
-        if(skb_get_hash(q->flows[idx].head)==skb_get_hash(skb))
-            return q->hashtable[hash1];
+/* Take a fq_codel_npow2 reference if n (0: unused) needs the generic path.
+ * It is kept until destroy, so this may only be called outside the lock.
+ */
+static void fq_codel_pow2_check(struct fq_codel_sched_data *q, u32 n)
+{
+	if (n && !is_power_of_2(n) && !q->npow2) {
+		static_branch_inc(&fq_codel_npow2);
+		q->npow2 = true;
+	}
+}
 
-		q->hashtable[hash2] = get_next_empty_flow(q) + 1;
-		return q->hashtable[hash2];
-    }
+/* Index slot of a key: one seeded hash per cuckoo table, seed 0 otherwise */
+static u32 fq_codel_index_slot(const struct fq_codel_sched_data *q, u32 hash,
+			       int seed)
+{
+	return fq_codel_scale(jhash_1word(hash, q->index_seed[seed]),
+			      q->index_range, q->index_shift);
+}
 
-    if(q->hashtable[hash1] == 0 && q->hashtable[hash2] != 0)
-    {
-        idx = q->hashtable[hash2] - 1;
+/* slot % index_slots; a power of two range means power of two slots */
+static u32 fq_codel_index_wrap(const struct fq_codel_sched_data *q, u32 slot)
+{
+	if (static_branch_unlikely(&fq_codel_npow2) && !q->index_shift)
+		return slot % q->index_slots;
+	return slot & (q->index_slots - 1);
+}
 
-		if(q->flows[idx].head==NULL)
-			return q->hashtable[hash2];
+/* Key of the flow an index entry points to */
+static u32 fq_codel_entry_hash(const struct fq_codel_sched_data *q, u32 entry)
+{
+	return q->flows[entry - 1].hash;
+}
 
-        if(skb_get_hash(q->flows[idx].head)==skb_get_hash(skb))
-            return q->hashtable[hash2];
-        
-		q->hashtable[hash1] = get_next_empty_flow(q) + 1;
-		return q->hashtable[hash1];
-        
-    }
+static u32 fq_codel_index_distance(const struct fq_codel_sched_data *q,
+				   u32 from, u32 to)
+{
+	return to >= from ? to - from : to + q->index_slots - from;
+}
 
-    idx = q->hashtable[hash1] - 1;
-    idx2 = q->hashtable[hash2] - 1;
+static u32 fq_codel_index_next(const struct fq_codel_sched_data *q, u32 slot)
+{
+	return ++slot == q->index_slots ? 0 : slot;
+}
 
-	if(q->flows[idx].head==NULL)
-		return q->hashtable[hash1];
+/*
+ * Stochastic: the original fq_codel mapping, the key picks its flow.
+ */
+static void fq_codel_stochastic_reset(struct fq_codel_sched_data *q)
+{
+}
 
-	if(skb_get_hash(q->flows[idx].head)==skb_get_hash(skb))
-        return q->hashtable[hash1];
-	
-	if(q->flows[idx2].head==NULL)
-		return q->hashtable[hash2];
+static unsigned int fq_codel_stochastic_lookup_or_insert(struct fq_codel_sched_data *q,
+							 u32 hash)
+{
+	return fq_codel_scale(hash, q->flows_cnt, q->flows_shift) + 1;
+}
 
-    if(skb_get_hash(q->flows[idx2].head)==skb_get_hash(skb))
-        return q->hashtable[hash2];
+static void fq_codel_stochastic_release(struct fq_codel_sched_data *q,
+					unsigned int idx)
+{
+}
 
-    /*
-     * If none of the above things prevail, then we have to allocate a new physical flow from the flows table to this packet.
-     * We will put it at hashtable[hash1] location.
-     * Then we will carry out rehashing of the other values in cuckoo fashion.
-     */
-    unsigned int value_to_insert = get_next_empty_flow(q) + 1;
+static int fq_codel_stochastic_resize(struct Qdisc *sch, u32 slots)
+{
+	return -EOPNOTSUPP;
+}
 
-    // Write that loop here to rehash stuff in the hashtable.
-    // Remember rehashing is simply moving the flows table indexes around in our hashtable. We are touching no flows here.
-    cuckoo_rehash(q,skb,value_to_insert);
+static void fq_codel_stochastic_stats(const struct fq_codel_sched_data *q,
+				      struct fq_codel_index_stats *st)
+{
+	st->slots = q->flows_cnt;
+}
 
-    return value_to_insert;
+/*
+ * Table backends: q->index[] holds 1-based flow numbers (0: free slot) and
+ * the keys stay in the flows, so the table only moves small integers around.
+ * The flows themselves come from the empty_flow_mask pool and go back to it
+ * when they drain. Entries are as narrow as flows_cnt allows, so the
+ * tables of small instances fit in a couple of cache lines.
+ */
+static u8 fq_codel_index_width(u32 flows_cnt)
+{
+	if (flows_cnt <= U8_MAX)
+		return sizeof(u8);
+	if (flows_cnt <= U16_MAX)
+		return sizeof(u16);
+	return sizeof(u32);
+}
 
-	// If you don't want to rehash and let the collision happen
-	// return q->hashtable[hash1];
+static u32 fq_codel_index_get(const struct fq_codel_sched_data *q, u32 slot)
+{
+	switch (q->index_width) {
+	case sizeof(u8):
+		return ((const u8 *)q->index)[slot];
+	case sizeof(u16):
+		return ((const u16 *)q->index)[slot];
+	default:
+		return ((const u32 *)q->index)[slot];
+	}
 }
 
-static unsigned int fq_codel_classify(struct sk_buff *skb, struct Qdisc *sch,
-				      int *qerr)
+static void fq_codel_index_set(struct fq_codel_sched_data *q, u32 slot,
+			       u32 entry)
+{
+	switch (q->index_width) {
+	case sizeof(u8):
+		((u8 *)q->index)[slot] = entry;
+		break;
+	case sizeof(u16):
+		((u16 *)q->index)[slot] = entry;
+		break;
+	default:
+		((u32 *)q->index)[slot] = entry;
+	}
+}
+
+static u32 fq_codel_index_xchg(struct fq_codel_sched_data *q, u32 slot,
+			       u32 entry)
+{
+	u32 old = fq_codel_index_get(q, slot);
+
+	fq_codel_index_set(q, slot, entry);
+	return old;
+}
+
+static u32 fq_codel_table_slots(const struct fq_codel_index_ops *ops,
+				u32 slots)
+{
+	return ops->slot_align ? round_down(slots, ops->slot_align) : 0;
+}
+
+/* what the backend hashes keys into: one value per slot_align slots */
+static u32 fq_codel_table_range(const struct fq_codel_index_ops *ops,
+				u32 slots)
+{
+	return ops->slot_align ? slots / ops->slot_align : 0;
+}
+
+/* A table is one block: q->index, then the tags, then the aux words, each
+ * starting on a cache line.
+ */
+static size_t fq_codel_table_size(const struct fq_codel_index_ops *ops,
+				  u32 slots, u8 width)
+{
+	size_t size = ALIGN((size_t)slots * width, SMP_CACHE_BYTES);
+
+	if (!slots)
+		return 0;
+	if (ops->tags)
+		size += ALIGN(slots * sizeof(u8), SMP_CACHE_BYTES);
+	if (ops->aux)
+		size += ALIGN(slots * sizeof(u32), SMP_CACHE_BYTES);
+	return size;
+}
+
+static void fq_codel_table_carve(const struct fq_codel_index_ops *ops,
+				 void *mem, u32 slots, u8 width, void **index,
+				 u32 **aux, u8 **tags)
+{
+	*index = slots ? mem : NULL;
+	mem += ALIGN((size_t)slots * width, SMP_CACHE_BYTES);
+	*tags = slots && ops->tags ? mem : NULL;
+	if (*tags)
+		mem += ALIGN(slots * sizeof(u8), SMP_CACHE_BYTES);
+	*aux = slots && ops->aux ? mem : NULL;
+}
+
+/* Only mapped flows own slots: removing them one by one empties the table
+ * in O(mapped flows) plus a scan of the bitmap words.
+ */
+static void fq_codel_table_reset(struct fq_codel_sched_data *q)
+{
+	unsigned int idx;
+
+	for_each_clear_bit(idx, q->empty_flow_mask, q->flows_cnt) {
+		q->index_ops->remove(q, idx);
+		fq_codel_flow_unmap(q, idx);
+	}
+}
+
+/* Token bucket on index inserts, in ns of credit: a key flood (random
+ * ports) beyond new_flow_rate is hashed stochastically instead of paying
+ * for a pool scan and an insert per packet.
+ */
+static bool fq_codel_new_flow_admit(struct fq_codel_sched_data *q)
+{
+	u64 now = ktime_get_ns();
+	u64 cost = div_u64(NSEC_PER_SEC, q->new_flow_rate);
+	u64 tokens = q->new_flow_tokens + (now - q->new_flow_stamp);
+
+	q->new_flow_stamp = now;
+	q->new_flow_tokens = min(tokens, cost * q->new_flow_burst);
+	if (q->new_flow_tokens < cost)
+		return false;
+	q->new_flow_tokens -= cost;
+	return true;
+}
+
+/* Hand the idle flow idx over to a new key, its previous owner getting a
+ * fresh mapping on its next packet.
+ */
+static bool fq_codel_table_evict(struct fq_codel_sched_data *q,
+				 unsigned int idx, u32 hash)
+{
+	struct fq_codel_flow *flow = &q->flows[idx];
+	u32 owner = flow->hash;
+
+	q->index_ops->remove(q, idx);
+	flow->hash = hash;
+	if (q->index_ops->insert(q, idx)) {
+		fq_codel_flow_set_key(flow, hash);
+		return true;
+	}
+	/* the slot we just freed takes the owner back */
+	flow->hash = owner;
+	q->index_ops->insert(q, idx);
+	return false;
+}
+
+/* No flow or no slot for a new key: apply q->exhaust_policy, among the
+ * flows the key's own probe would visit. Eviction only takes a mapped flow
+ * that holds no packet and waits for no EDT, so no queued packet changes
+ * owner and gets overtaken, and of those the one whose owner was sending
+ * slowest by its rate estimate. A drained flow may still sit on a DRR list:
+ * the new key takes it off and activates it afresh. Flows with a BLUE
+ * probability are left to their key. Without a candidate it falls back to
+ * sharing the least backlogged one, the slowest of those backlogged alike.
+ * Whatever the policy, an idle flow kept only for its BLUE state goes to
+ * the new key once that state has decayed.
+ */
+static unsigned int fq_codel_table_exhausted(struct fq_codel_sched_data *q,
+					     u32 hash)
+{
+	u32 cand[FQ_CODEL_INDEX_CANDIDATES];
+	unsigned int i, n, best = 0;
+	u64 load, min = 0;
+
+	n = q->index_ops->candidates(q, hash, cand);
+	for (i = 0; i < n; i++) {
+		unsigned int idx = cand[i] - 1;
+		struct fq_codel_flow *flow = &q->flows[idx];
+
+		/* only held for a BLUE probability that has decayed by now */
+		if (fq_codel_flow_mapped(q, idx) && fq_codel_flow_idle(flow) &&
+		    fq_codel_blue_expired(q, flow) &&
+		    fq_codel_table_evict(q, idx, hash))
+			return cand[i];
+	}
+
+	if (q->exhaust_policy == FQ_CODEL_EXHAUST_OVERFLOW && q->overflow_cnt) {
+		q->exhaust_overflow++;
+		return fq_codel_overflow_flow(q, hash) + 1;
+	}
+
+	if (q->exhaust_policy == FQ_CODEL_EXHAUST_EVICT) {
+		for (i = 0; i < n; i++) {
+			unsigned int idx = cand[i] - 1;
+			struct fq_codel_flow *flow = &q->flows[idx];
+
+			if (!fq_codel_flow_mapped(q, idx) || flow->head ||
+			    fq_codel_flow_is_throttled(flow) ||
+			    (q->blue && flow->blue_prob))
+				continue;
+			load = fq_codel_flow_load(q, idx);
+			if (!best || load < min) {
+				min = load;
+				best = cand[i];
+			}
+		}
+		if (best && fq_codel_table_evict(q, best - 1, hash)) {
+			q->exhaust_evict++;
+			return best;
+		}
+		best = 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		unsigned int idx = cand[i] - 1;
+
+		load = (u64)q->backlogs[idx] << 32 | q->flows[idx].rate_bps;
+		if (!best || load < min) {
+			min = load;
+			best = cand[i];
+		}
+	}
+	if (best) {
+		q->exhaust_share++;
+		return best;
+	}
+
+	/* an empty probe (Robin Hood with a free home slot) has nothing to
+	 * share: spread such keys as the stochastic index would
+	 */
+	q->exhaust_hashed++;
+	if (q->overflow_cnt)
+		return fq_codel_overflow_flow(q, hash) + 1;
+	return fq_codel_scale(hash, q->flows_cnt, q->flows_shift) + 1;
+}
+
+static unsigned int fq_codel_table_lookup_or_insert(struct fq_codel_sched_data *q,
+						    u32 hash)
+{
+	unsigned int idx = q->index_ops->lookup(q, hash);
+
+	if (idx)
+		return idx;
+
+	if (q->new_flow_rate && !fq_codel_new_flow_admit(q)) {
+		q->new_flow_throttled++;
+		if (q->overflow_cnt)
+			return fq_codel_overflow_flow(q, hash) + 1;
+		return fq_codel_scale(hash, q->flows_cnt, q->flows_shift) + 1;
+	}
+
+	idx = get_next_empty_flow(q);
+	if (idx < q->flows_cnt) {
+		fq_codel_flow_map(q, idx, hash);
+		if (q->index_ops->insert(q, idx))
+			return idx + 1;
+		fq_codel_flow_unmap(q, idx);
+	}
+	q->index_failures++;
+	return fq_codel_table_exhausted(q, hash);
+}
+
+static void fq_codel_table_release(struct fq_codel_sched_data *q,
+				   unsigned int idx)
+{
+	if (!fq_codel_flow_mapped(q, idx))
+		return;
+	q->index_ops->remove(q, idx);
+	fq_codel_flow_unmap(q, idx);
+}
+
+/* Rebuild the index with a new slot count. The table is allocated outside
+ * the qdisc lock; if live flows do not all fit, the old one is kept.
+ */
+static int fq_codel_table_resize(struct Qdisc *sch, u32 slots)
 {
 	struct fq_codel_sched_data *q = qdisc_priv(sch);
-	struct tcf_proto *filter;
-	struct tcf_result res;
-	int result;
+	u32 *aux, range;
+	u8 *tags, shift;
+	void *index;
+	unsigned int idx;
+	void *mem;
+
+	slots = fq_codel_table_slots(q->index_ops, slots);
+	mem = kvzalloc(fq_codel_table_size(q->index_ops, slots, q->index_width),
+		       GFP_KERNEL);
+	if (!mem)
+		return -ENOMEM;
+	fq_codel_table_carve(q->index_ops, mem, slots, q->index_width,
+			     &index, &aux, &tags);
+	range = fq_codel_table_range(q->index_ops, slots);
+	shift = fq_codel_pow2_shift(range);
+	fq_codel_pow2_check(q, range);
+
+	sch_tree_lock(sch);
+	swap(q->index, index);
+	swap(q->index_aux, aux);
+	swap(q->index_tags, tags);
+	swap(q->index_slots, slots);
+	swap(q->index_range, range);
+	swap(q->index_shift, shift);
+	swap(q->index_mem, mem);
+	for (idx = 0; idx < q->flows_cnt; idx++) {
+		if (fq_codel_flow_mapped(q, idx) && !q->index_ops->insert(q, idx))
+			break;
+	}
+	if (idx < q->flows_cnt) {
+		swap(q->index, index);
+		swap(q->index_aux, aux);
+		swap(q->index_tags, tags);
+		swap(q->index_slots, slots);
+		swap(q->index_range, range);
+		swap(q->index_shift, shift);
+		swap(q->index_mem, mem);
+	}
+	sch_tree_unlock(sch);
+
+	/* NULL when the old table lived in the arena */
+	kvfree(mem);
+	return idx < q->flows_cnt ? -ENOSPC : 0;
+}
+
+static void fq_codel_table_stats(const struct fq_codel_sched_data *q,
+				 struct fq_codel_index_stats *st)
+{
+	st->slots = q->index_slots;
+}
+
+/*
+ * Cuckoo: every key has two candidate buckets of FQ_CODEL_CUCKOO_WAYS slots.
+ * Next to q->index, q->index_tags keeps an 8 bit tag of each slot's key
+ * (0: free), so a bucket's tags are one 64 bit word: a probe compares them
+ * all at once with a SWAR zero byte test and only dereferences flows whose
+ * tag matched. An insert that finds both buckets full displaces occupants
+ * to their other bucket, up to FQ_CODEL_CUCKOO_MAX_KICKS times; a failed
+ * chain is rolled back.
+ */
+static u32 fq_codel_cuckoo_bucket(const struct fq_codel_sched_data *q,
+				  u32 hash, int table)
+{
+	return fq_codel_index_slot(q, hash, table);
+}
+
+static u8 fq_codel_cuckoo_tag(u32 hash)
+{
+	return (hash >> 24) ?: 1;
+}
+
+/* One bit (0x80 of the byte) per slot of bucket whose tag may be tag.
+ * Bytes above a real match can be false positives, the lowest one never.
+ */
+static u64 fq_codel_cuckoo_match(const struct fq_codel_sched_data *q,
+				 u32 bucket, u8 tag)
+{
+	const __le64 *tags = (const __le64 *)q->index_tags + bucket;
+	u64 x = le64_to_cpup(tags) ^ (FQ_CODEL_CUCKOO_ONES * tag);
+
+	return (x - FQ_CODEL_CUCKOO_ONES) & ~x & (FQ_CODEL_CUCKOO_ONES << 7);
+}
+
+static unsigned int fq_codel_cuckoo_lookup(struct fq_codel_sched_data *q,
+					   u32 hash)
+{
+	u8 tag = fq_codel_cuckoo_tag(hash);
+	int table;
+
+	for (table = 0; table < 2; table++) {
+		u32 bucket = fq_codel_cuckoo_bucket(q, hash, table);
+		u64 match = fq_codel_cuckoo_match(q, bucket, tag);
+
+		while (match) {
+			u32 slot = bucket * FQ_CODEL_CUCKOO_WAYS +
+				   (__ffs64(match) >> 3);
+			u32 entry = fq_codel_index_get(q, slot);
+
+			if (entry && fq_codel_entry_hash(q, entry) == hash)
+				return entry;
+			match &= match - 1;
+		}
+	}
+	return 0;
+}
+
+/* Store entry in a free slot of bucket, if it has one */
+static bool fq_codel_cuckoo_place(struct fq_codel_sched_data *q, u32 bucket,
+				  u32 entry, u8 tag)
+{
+	u64 match = fq_codel_cuckoo_match(q, bucket, 0);
+	u32 slot;
+
+	if (!match)
+		return false;
+	slot = bucket * FQ_CODEL_CUCKOO_WAYS + (__ffs64(match) >> 3);
+	fq_codel_index_set(q, slot, entry);
+	q->index_tags[slot] = tag;
+	return true;
+}
+
+static bool fq_codel_cuckoo_insert(struct fq_codel_sched_data *q,
+				   unsigned int idx)
+{
+	u32 path[FQ_CODEL_CUCKOO_MAX_KICKS];
+	u32 hash = q->flows[idx].hash, entry = idx + 1, bucket, alt;
+	u8 tag = fq_codel_cuckoo_tag(hash);
+	int kicks;
+
+	bucket = fq_codel_cuckoo_bucket(q, hash, 0);
+	if (fq_codel_cuckoo_place(q, bucket, entry, tag) ||
+	    fq_codel_cuckoo_place(q, fq_codel_cuckoo_bucket(q, hash, 1),
+				  entry, tag))
+		return true;
+
+	for (kicks = 0; kicks < FQ_CODEL_CUCKOO_MAX_KICKS; kicks++) {
+		u32 slot = bucket * FQ_CODEL_CUCKOO_WAYS +
+			   ((hash + kicks) & (FQ_CODEL_CUCKOO_WAYS - 1));
+
+		entry = fq_codel_index_xchg(q, slot, entry);
+		swap(tag, q->index_tags[slot]);
+		path[kicks] = slot;
+		q->index_moves++;
+
+		hash = fq_codel_entry_hash(q, entry);
+		alt = fq_codel_cuckoo_bucket(q, hash, 0);
+		if (alt == bucket)
+			alt = fq_codel_cuckoo_bucket(q, hash, 1);
+		if (fq_codel_cuckoo_place(q, alt, entry, tag))
+			return true;
+		bucket = alt;
+	}
+	while (kicks--) {
+		entry = fq_codel_index_xchg(q, path[kicks], entry);
+		swap(tag, q->index_tags[path[kicks]]);
+	}
+	return false;
+}
+
+static unsigned int fq_codel_cuckoo_candidates(struct fq_codel_sched_data *q,
+					       u32 hash, u32 *cand)
+{
+	unsigned int n = 0;
+	int table, way;
+
+	for (table = 0; table < 2; table++) {
+		u32 slot = fq_codel_cuckoo_bucket(q, hash, table) *
+			   FQ_CODEL_CUCKOO_WAYS;
+
+		for (way = 0; way < FQ_CODEL_CUCKOO_WAYS; way++, slot++) {
+			if (fq_codel_index_get(q, slot))
+				cand[n++] = fq_codel_index_get(q, slot);
+		}
+	}
+	return n;
+}
+
+static void fq_codel_cuckoo_remove(struct fq_codel_sched_data *q,
+				   unsigned int idx)
+{
+	u32 hash = q->flows[idx].hash;
+	u8 tag = fq_codel_cuckoo_tag(hash);
+	int table;
+
+	for (table = 0; table < 2; table++) {
+		u32 bucket = fq_codel_cuckoo_bucket(q, hash, table);
+		u64 match = fq_codel_cuckoo_match(q, bucket, tag);
+
+		while (match) {
+			u32 slot = bucket * FQ_CODEL_CUCKOO_WAYS +
+				   (__ffs64(match) >> 3);
+
+			if (fq_codel_index_get(q, slot) == idx + 1) {
+				fq_codel_index_set(q, slot, 0);
+				q->index_tags[slot] = 0;
+				return;
+			}
+			match &= match - 1;
+		}
+	}
+}
+
+/*
+ * Hopscotch: a key lives within FQ_CODEL_HOP_RANGE slots of its home slot,
+ * whose index_aux bitmap tells which of them hold its keys. An insert
+ * probes linearly for a free slot and hops it back towards home by moving
+ * keys that stay inside their own neighbourhood.
+ */
+#define FQ_CODEL_HOP_RANGE	32
+#define FQ_CODEL_HOP_PROBE	512
+
+static unsigned int fq_codel_hopscotch_lookup(struct fq_codel_sched_data *q,
+					      u32 hash)
+{
+	u32 home = fq_codel_index_slot(q, hash, 0);
+	unsigned long hop = q->index_aux[home];
+	unsigned int bit;
+
+	for_each_set_bit(bit, &hop, FQ_CODEL_HOP_RANGE) {
+		u32 slot = fq_codel_index_wrap(q, home + bit);
+		u32 entry = fq_codel_index_get(q, slot);
+
+		if (entry && fq_codel_entry_hash(q, entry) == hash)
+			return entry;
+	}
+	return 0;
+}
+
+static bool fq_codel_hopscotch_insert(struct fq_codel_sched_data *q,
+				      unsigned int idx)
+{
+	u32 home = fq_codel_index_slot(q, q->flows[idx].hash, 0);
+	u32 probe = min_t(u32, FQ_CODEL_HOP_PROBE, q->index_slots);
+	u32 free = home, dist;
+
+	for (dist = 0; dist < probe; dist++) {
+		if (!fq_codel_index_get(q, free))
+			break;
+		free = fq_codel_index_next(q, free);
+	}
+	if (dist == probe)
+		return false;
+
+	while (dist >= FQ_CODEL_HOP_RANGE) {
+		u32 off, bucket = fq_codel_index_wrap(q, free + q->index_slots -
+						      (FQ_CODEL_HOP_RANGE - 1));
+		bool moved = false;
+
+		/* the furthest bucket first: it can hop the longest way */
+		for (off = FQ_CODEL_HOP_RANGE - 1; off > 0 && !moved; off--) {
+			unsigned long hop = q->index_aux[bucket];
+			unsigned int bit = find_first_bit(&hop, off);
+
+			if (bit < off) {
+				u32 from = fq_codel_index_wrap(q, bucket + bit);
+
+				fq_codel_index_set(q, free, fq_codel_index_get(q, from));
+				fq_codel_index_set(q, from, 0);
+				q->index_aux[bucket] &= ~(1U << bit);
+				q->index_aux[bucket] |= 1U << off;
+				q->index_moves++;
+				dist -= fq_codel_index_distance(q, from, free);
+				free = from;
+				moved = true;
+			}
+			bucket = fq_codel_index_next(q, bucket);
+		}
+		if (!moved)
+			return false;
+	}
+	fq_codel_index_set(q, free, idx + 1);
+	q->index_aux[home] |= 1U << dist;
+	return true;
+}
+
+static unsigned int fq_codel_hopscotch_candidates(struct fq_codel_sched_data *q,
+						  u32 hash, u32 *cand)
+{
+	u32 slot = fq_codel_index_slot(q, hash, 0);
+	unsigned int n = 0;
+	int i;
+
+	for (i = 0; i < FQ_CODEL_HOP_RANGE; i++) {
+		if (fq_codel_index_get(q, slot))
+			cand[n++] = fq_codel_index_get(q, slot);
+		slot = fq_codel_index_next(q, slot);
+	}
+	return n;
+}
+
+static void fq_codel_hopscotch_remove(struct fq_codel_sched_data *q,
+				      unsigned int idx)
+{
+	u32 home = fq_codel_index_slot(q, q->flows[idx].hash, 0);
+	unsigned long hop = q->index_aux[home];
+	unsigned int bit;
+
+	for_each_set_bit(bit, &hop, FQ_CODEL_HOP_RANGE) {
+		u32 slot = fq_codel_index_wrap(q, home + bit);
+
+		if (fq_codel_index_get(q, slot) == idx + 1) {
+			fq_codel_index_set(q, slot, 0);
+			q->index_aux[home] &= ~(1U << bit);
+			return;
+		}
+	}
+}
+
+/*
+ * Robin Hood: linear probing where an insert takes the slot of any key
+ * sitting closer to its home than the newcomer is (index_aux holds that
+ * distance), which keeps probe lengths even and lets a lookup stop early.
+ * Removal shifts the following run back by one slot.
+ */
+static unsigned int fq_codel_robin_hood_lookup(struct fq_codel_sched_data *q,
+					       u32 hash)
+{
+	u32 slot = fq_codel_index_slot(q, hash, 0);
+	u32 dist;
+
+	for (dist = 0; dist < q->index_slots; dist++) {
+		u32 entry = fq_codel_index_get(q, slot);
+
+		if (!entry || q->index_aux[slot] < dist)
+			break;
+		if (fq_codel_entry_hash(q, entry) == hash)
+			return entry;
+		slot = fq_codel_index_next(q, slot);
+	}
+	return 0;
+}
+
+/* There is always a free slot: at least one flow is in the pool and the
+ * table has at least as many slots as there are flows.
+ */
+static bool fq_codel_robin_hood_insert(struct fq_codel_sched_data *q,
+				       unsigned int idx)
+{
+	u32 slot = fq_codel_index_slot(q, q->flows[idx].hash, 0);
+	u32 entry = idx + 1, dist = 0;
+
+	while (fq_codel_index_get(q, slot)) {
+		if (q->index_aux[slot] < dist) {
+			entry = fq_codel_index_xchg(q, slot, entry);
+			swap(dist, q->index_aux[slot]);
+			q->index_moves++;
+		}
+		slot = fq_codel_index_next(q, slot);
+		dist++;
+	}
+	fq_codel_index_set(q, slot, entry);
+	q->index_aux[slot] = dist;
+	return true;
+}
+
+static unsigned int fq_codel_robin_hood_candidates(struct fq_codel_sched_data *q,
+						   u32 hash, u32 *cand)
+{
+	u32 slot = fq_codel_index_slot(q, hash, 0);
+	unsigned int n = 0;
+
+	while (n < FQ_CODEL_INDEX_CANDIDATES && fq_codel_index_get(q, slot)) {
+		cand[n++] = fq_codel_index_get(q, slot);
+		slot = fq_codel_index_next(q, slot);
+	}
+	return n;
+}
+
+static void fq_codel_robin_hood_remove(struct fq_codel_sched_data *q,
+				       unsigned int idx)
+{
+	u32 slot = fq_codel_index_slot(q, q->flows[idx].hash, 0);
+	u32 next, dist;
+
+	for (dist = 0; fq_codel_index_get(q, slot) != idx + 1; dist++) {
+		if (!fq_codel_index_get(q, slot) || q->index_aux[slot] < dist)
+			return;
+		slot = fq_codel_index_next(q, slot);
+	}
+
+	next = fq_codel_index_next(q, slot);
+	while (fq_codel_index_get(q, next) && q->index_aux[next]) {
+		fq_codel_index_set(q, slot, fq_codel_index_get(q, next));
+		q->index_aux[slot] = q->index_aux[next] - 1;
+		slot = next;
+		next = fq_codel_index_next(q, next);
+	}
+	fq_codel_index_set(q, slot, 0);
+	q->index_aux[slot] = 0;
+}
+
+/* hopscotch keeps neighbourhood bitmaps in aux, robin hood probe distances */
+static const struct fq_codel_index_ops fq_codel_index_backends[FQ_CODEL_INDEX_MAX] = {
+	[FQ_CODEL_INDEX_STOCHASTIC] = {
+		.reset			= fq_codel_stochastic_reset,
+		.lookup_or_insert	= fq_codel_stochastic_lookup_or_insert,
+		.release		= fq_codel_stochastic_release,
+		.resize			= fq_codel_stochastic_resize,
+		.stats			= fq_codel_stochastic_stats,
+	},
+	[FQ_CODEL_INDEX_CUCKOO] = {
+		.slot_align		= FQ_CODEL_CUCKOO_WAYS,
+		.tags			= true,
+		.reset			= fq_codel_table_reset,
+		.lookup_or_insert	= fq_codel_table_lookup_or_insert,
+		.release		= fq_codel_table_release,
+		.resize			= fq_codel_table_resize,
+		.stats			= fq_codel_table_stats,
+		.lookup			= fq_codel_cuckoo_lookup,
+		.insert			= fq_codel_cuckoo_insert,
+		.remove			= fq_codel_cuckoo_remove,
+		.candidates		= fq_codel_cuckoo_candidates,
+	},
+	[FQ_CODEL_INDEX_HOPSCOTCH] = {
+		.slot_align		= 1,
+		.aux			= true,
+		.reset			= fq_codel_table_reset,
+		.lookup_or_insert	= fq_codel_table_lookup_or_insert,
+		.release		= fq_codel_table_release,
+		.resize			= fq_codel_table_resize,
+		.stats			= fq_codel_table_stats,
+		.lookup			= fq_codel_hopscotch_lookup,
+		.insert			= fq_codel_hopscotch_insert,
+		.remove			= fq_codel_hopscotch_remove,
+		.candidates		= fq_codel_hopscotch_candidates,
+	},
+	[FQ_CODEL_INDEX_ROBIN_HOOD] = {
+		.slot_align		= 1,
+		.aux			= true,
+		.reset			= fq_codel_table_reset,
+		.lookup_or_insert	= fq_codel_table_lookup_or_insert,
+		.release		= fq_codel_table_release,
+		.resize			= fq_codel_table_resize,
+		.stats			= fq_codel_table_stats,
+		.lookup			= fq_codel_robin_hood_lookup,
+		.insert			= fq_codel_robin_hood_insert,
+		.remove			= fq_codel_robin_hood_remove,
+		.candidates		= fq_codel_robin_hood_candidates,
+	},
+};
+
+/* With TCA_FQ_CODEL_CLASSID_INDEX, class ids are keys of the flow index
+ * like packet hashes, so their space is not bounded by flows_cnt. They are
+ * hashed with a seed of their own to keep them apart from packet hashes.
+ */
+static unsigned int fq_codel_classid_flow(struct fq_codel_sched_data *q,
+					  u32 classid)
+{
+	return q->index_ops->lookup_or_insert(q, jhash_1word(classid,
+							      q->classid_seed));
+}
+
+static unsigned int fq_codel_classify(struct sk_buff *skb, struct Qdisc *sch,
+				      int *qerr, u8 *weight)
+{
+	struct fq_codel_sched_data *q = qdisc_priv(sch);
+	struct tcf_proto *filter;
+	struct tcf_result res;
+	int result;
+
+	if (TC_H_MAJ(skb->priority) == sch->handle &&
+	    TC_H_MIN(skb->priority) > 0) {
+		if (q->classid_index)
+			return fq_codel_classid_flow(q, skb->priority);
+		if (TC_H_MIN(skb->priority) <= q->flows_cnt)
+			return TC_H_MIN(skb->priority);
+	}
+
+	filter = rcu_dereference_bh(q->filter_list);
+	if (!filter)
+		return q->index_ops->lookup_or_insert(q, skb_get_hash(skb));
+
+	*qerr = NET_XMIT_SUCCESS | __NET_XMIT_BYPASS;
+	result = tcf_classify(skb, filter, &res, false);
+	if (result >= 0) {
+#ifdef CONFIG_NET_CLS_ACT
+		switch (result) {
+		case TC_ACT_STOLEN:
+		case TC_ACT_QUEUED:
+		case TC_ACT_TRAP:
+			*qerr = NET_XMIT_SUCCESS | __NET_XMIT_STOLEN;
+			/* fall through */
+		case TC_ACT_SHOT:
+			return 0;
+		}
+#endif
+		if (q->weights && TC_H_MAJ(res.classid) &&
+		    TC_H_MAJ(res.classid) != sch->handle) {
+			*weight = clamp_t(u32, TC_H_MAJ(res.classid) >> 16,
+					  1, U8_MAX);
+			res.classid = TC_H_MIN(res.classid);
+		}
+		if (q->classid_index && res.classid)
+			return fq_codel_classid_flow(q, res.classid);
+		if (TC_H_MIN(res.classid) <= q->flows_cnt)
+			return TC_H_MIN(res.classid);
+	}
+	return 0;
+}
+
+/* Return the DS field of an IPv4/IPv6 packet, 0 for anything else */
+static u8 fq_codel_get_dsfield(struct sk_buff *skb)
+{
+	int wlen = skb_network_offset(skb);
+
+	switch (tc_skb_protocol(skb)) {
+	case htons(ETH_P_IP):
+		wlen += sizeof(struct iphdr);
+		if (!pskb_may_pull(skb, wlen))
+			return 0;
+		return ipv4_get_dsfield(ip_hdr(skb));
+	case htons(ETH_P_IPV6):
+		wlen += sizeof(struct ipv6hdr);
+		if (!pskb_may_pull(skb, wlen))
+			return 0;
+		return ipv6_get_dsfield(ipv6_hdr(skb));
+	default:
+		return 0;
+	}
+}
+
+static u8 fq_codel_classify_tin(const struct fq_codel_sched_data *q,
+				struct sk_buff *skb)
+{
+	if (q->tin_cnt == 1)
+		return 0;
+
+	switch (fq_codel_get_dsfield(skb) >> 2) {
+	case 1:		/* LE */
+	case 8:		/* CS1 */
+		return 0;
+	case 32:	/* CS4 */
+	case 40:	/* CS5 */
+	case 44:	/* VA */
+	case 46:	/* EF */
+	case 48:	/* CS6 */
+	case 56:	/* CS7 */
+		return q->tin_cnt - 1;
+	case 16:	/* CS2 */
+	case 18:	/* AF21 */
+	case 20:	/* AF22 */
+	case 22:	/* AF23 */
+	case 24:	/* CS3 */
+	case 26:	/* AF31 */
+	case 28:	/* AF32 */
+	case 30:	/* AF33 */
+	case 34:	/* AF41 */
+	case 36:	/* AF42 */
+	case 38:	/* AF43 */
+		return q->tin_cnt == 4 ? 2 : 1;
+	default:
+		return 1;
+	}
+}
+
+static void fq_codel_set_tin_quantum(struct fq_codel_sched_data *q)
+{
+	int i;
+
+	for (i = 0; i < q->tin_cnt; i++)
+		q->tins[i].quantum = max_t(u32, 1,
+					   (q->quantum * fq_codel_tin_weight[q->tin_cnt][i]) >>
+					   FQ_CODEL_TIN_WEIGHT_SHIFT);
+}
+
+static bool fq_codel_tin_active(const struct fq_codel_tin *tin)
+{
+	return !list_empty(&tin->new_flows) || !list_empty(&tin->old_flows);
+}
+
+/* Pick the highest priority backlogged tin that still has deficit. When all
+ * of them are spent, a new tin round starts: backlogged tins are credited
+ * at once with as many quanta as the first of them needs to go positive,
+ * idle ones start over with a single quantum.
+ */
+static struct fq_codel_tin *fq_codel_select_tin(struct fq_codel_sched_data *q)
+{
+	struct fq_codel_tin *tin;
+	u32 rounds = U32_MAX;
+	int i;
+
+	if (q->tin_cnt == 1)
+		return fq_codel_tin_active(q->tins) ? q->tins : NULL;
+
+again:
+	for (i = q->tin_cnt - 1; i >= 0; i--) {
+		tin = &q->tins[i];
+		if (!fq_codel_tin_active(tin))
+			continue;
+		if (tin->deficit > 0)
+			return tin;
+		rounds = min_t(u32, rounds, (u32)-tin->deficit / tin->quantum + 1);
+	}
+	if (rounds == U32_MAX)
+		return NULL;
+
+	for (i = 0; i < q->tin_cnt; i++) {
+		tin = &q->tins[i];
+		if (fq_codel_tin_active(tin))
+			tin->deficit += rounds * tin->quantum;
+		else
+			tin->deficit = tin->quantum;
+	}
+	rounds = U32_MAX;
+	goto again;
+}
+
+/* RFC 9331: ECT(1) identifies L4S traffic, and so does CE */
+static bool fq_codel_skb_is_l4s(struct sk_buff *skb)
+{
+	u8 ecn = fq_codel_get_dsfield(skb) & INET_ECN_MASK;
+
+	return ecn == INET_ECN_ECT_1 || ecn == INET_ECN_CE;
+}
+
+/* codel's cb, plus what enqueue learnt about the packet */
+struct fq_codel_skb_cb {
+	struct codel_skb_cb codel;
+	bool		    l4s;	/* ECT(1) or CE at enqueue */
+};
+
+static struct fq_codel_skb_cb *fq_codel_skb_cb(const struct sk_buff *skb)
+{
+	qdisc_cb_private_validate(skb, sizeof(struct fq_codel_skb_cb));
+	return (struct fq_codel_skb_cb *)qdisc_skb_cb(skb)->data;
+}
+
+/* What the ACK filter needs to know about a pure TCP ACK */
+struct fq_codel_pure_ack {
+	__be32	addrs[8];	/* saddr, daddr (IPv4 uses the first two) */
+	__be32	ports;
+	__be32	ack_seq;
+	__be32	flags;
+};
+
+/* Parse skb as a pure ACK: no payload, no SYN/FIN/RST/URG/PSH/CWR, and no
+ * TCP option but timestamps. SACK blocks in particular carry information a
+ * later ACK may not repeat, so such ACKs are never filtered.
+ */
+static bool fq_codel_parse_pure_ack(const struct sk_buff *skb,
+				    struct fq_codel_pure_ack *ack)
+{
+	unsigned int offset = skb_network_offset(skb);
+	u8 _opts[MAX_TCP_OPTION_SPACE];
+	const struct tcphdr *th;
+	struct tcphdr _th;
+	unsigned int thlen, i;
+	const u8 *opts;
+	int payload;
+
+	memset(ack, 0, sizeof(*ack));
+	switch (tc_skb_protocol(skb)) {
+	case htons(ETH_P_IP): {
+		const struct iphdr *iph;
+		struct iphdr _iph;
+
+		iph = skb_header_pointer(skb, offset, sizeof(_iph), &_iph);
+		if (!iph || iph->protocol != IPPROTO_TCP ||
+		    iph->frag_off & htons(IP_MF | IP_OFFSET))
+			return false;
+		ack->addrs[0] = iph->saddr;
+		ack->addrs[1] = iph->daddr;
+		payload = ntohs(iph->tot_len) - iph->ihl * 4;
+		offset += iph->ihl * 4;
+		break;
+	}
+	case htons(ETH_P_IPV6): {
+		const struct ipv6hdr *ip6h;
+		struct ipv6hdr _ip6h;
+
+		ip6h = skb_header_pointer(skb, offset, sizeof(_ip6h), &_ip6h);
+		if (!ip6h || ip6h->nexthdr != IPPROTO_TCP)
+			return false;
+		memcpy(&ack->addrs[0], &ip6h->saddr, sizeof(ip6h->saddr));
+		memcpy(&ack->addrs[4], &ip6h->daddr, sizeof(ip6h->daddr));
+		payload = ntohs(ip6h->payload_len);
+		offset += sizeof(*ip6h);
+		break;
+	}
+	default:
+		return false;
+	}
+
+	th = skb_header_pointer(skb, offset, sizeof(_th), &_th);
+	if (!th)
+		return false;
+	thlen = th->doff * 4;
+	if (thlen < sizeof(*th) || payload != thlen)
+		return false;
+
+	ack->flags = tcp_flag_word(th) & (TCP_FLAG_ACK | TCP_FLAG_SYN |
+					  TCP_FLAG_FIN | TCP_FLAG_RST |
+					  TCP_FLAG_URG | TCP_FLAG_PSH |
+					  TCP_FLAG_ECE | TCP_FLAG_CWR);
+	if (ack->flags != TCP_FLAG_ACK &&
+	    ack->flags != (TCP_FLAG_ACK | TCP_FLAG_ECE))
+		return false;
+	memcpy(&ack->ports, &th->source, sizeof(ack->ports));
+	ack->ack_seq = th->ack_seq;
+
+	thlen -= sizeof(*th);
+	if (!thlen)
+		return true;
+	opts = skb_header_pointer(skb, offset + sizeof(*th), thlen, _opts);
+	if (!opts)
+		return false;
+	for (i = 0; i < thlen; ) {
+		switch (opts[i]) {
+		case TCPOPT_EOL:
+			return true;
+		case TCPOPT_NOP:
+			i++;
+			break;
+		case TCPOPT_TIMESTAMP:
+			if (i + 1 >= thlen || opts[i + 1] != TCPOLEN_TIMESTAMP)
+				return false;
+			i += TCPOLEN_TIMESTAMP;
+			break;
+		default:
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Same connection, same flags, and strictly newer: duplicate ACKs are loss
+ * signals and are never superseded.
+ */
+static bool fq_codel_ack_supersedes(const struct fq_codel_pure_ack *ack,
+				    const struct fq_codel_pure_ack *old)
+{
+	return !memcmp(ack->addrs, old->addrs, sizeof(ack->addrs)) &&
+	       ack->ports == old->ports && ack->flags == old->flags &&
+	       after(ntohl(ack->ack_seq), ntohl(old->ack_seq));
+}
+
+/* helper functions : might be changed when/if skb use a standard list_head */
+
+/* remove one skb from head of slot queue */
+static inline struct sk_buff *dequeue_head(struct fq_codel_flow *flow)
+{
+	struct sk_buff *skb = flow->head;
+
+	flow->head = skb->next;
+	if (flow->head)
+		flow->head_time = codel_get_enqueue_time(flow->head);
+	if (flow->ack_prev == skb)
+		flow->ack_prev = NULL;
+	skb_mark_not_on_list(skb);
+	return skb;
+}
+
+/* add skb to flow queue (tail add) */
+static inline void flow_queue_add(struct fq_codel_flow *flow,
+				  struct sk_buff *skb)
+{
+	if (flow->head == NULL) {
+		flow->head = skb;
+		flow->head_time = codel_get_enqueue_time(skb);
+	} else
+		flow->tail->next = skb;
+	flow->tail = skb;
+	skb->next = NULL;
+}
+
+/* The flow kept growing until it was picked as the fat flow to drop from:
+ * raise its BLUE probability, at most once per target.
+ */
+static void fq_codel_blue_queue_full(const struct fq_codel_sched_data *q,
+				     struct fq_codel_flow *flow)
+{
+	codel_time_t now = codel_get_time();
+
+	if (codel_time_after(now, flow->blue_time + q->cparams.target)) {
+		flow->blue_prob += FQ_CODEL_BLUE_INC;
+		if (flow->blue_prob < FQ_CODEL_BLUE_INC)
+			flow->blue_prob = ~0U;
+		flow->blue_time = now;
+	}
+}
+
+/* The flow drained its queue: it responds, so relax its BLUE probability */
+static void fq_codel_blue_queue_empty(const struct fq_codel_sched_data *q,
+				      struct fq_codel_flow *flow)
+{
+	codel_time_t now = codel_get_time();
+
+	if (flow->blue_prob &&
+	    codel_time_after(now, flow->blue_time + q->cparams.target)) {
+		if (flow->blue_prob < FQ_CODEL_BLUE_DEC)
+			flow->blue_prob = 0;
+		else
+			flow->blue_prob -= FQ_CODEL_BLUE_DEC;
+		flow->blue_time = now;
+	}
+}
+
+/* Victim scan of the policies other than bytes. Only backlogged
+ * flows are looked at, so the flow array is touched for those alone. Paced
+ * flows have a head time in the future and count as not waiting yet.
+ */
+static unsigned int fq_codel_drop_victim(const struct fq_codel_sched_data *q)
+{
+	codel_time_t now = codel_get_time();
+	unsigned int idx = 0, i;
+	u64 score, best = 0;
+
+	for (i = 0; i < q->flows_cnt; i++) {
+		s32 age;
+
+		if (!q->backlogs[i])
+			continue;
+		if (q->drop_policy == FQ_CODEL_DROP_RATE) {
+			score = fq_codel_flow_load(q, i);
+		} else {
+			age = (s32)(now - q->flows[i].head_time);
+			score = max(age, 1);
+			if (q->drop_policy == FQ_CODEL_DROP_WEIGHTED)
+				score *= q->backlogs[i];
+		}
+		if (score > best) {
+			best = score;
+			idx = i;
+		}
+	}
+	return idx;
+}
+
+static unsigned int fq_codel_drop(struct Qdisc *sch, unsigned int max_packets,
+				  struct sk_buff **to_free)
+{
+	struct fq_codel_sched_data *q = qdisc_priv(sch);
+	struct sk_buff *skb;
+	unsigned int maxbacklog = 0, idx = 0, i, len;
+	struct fq_codel_flow *flow;
+	unsigned int threshold;
+	unsigned int mem = 0;
+
+	/* Queue is full! Find the fat flow and drop packet(s) from it.
+	 * This might sound expensive, but with 1024 flows, we scan
+	 * 4KB of memory, and we dont need to handle a complex tree
+	 * in fast path (packet queue/enqueue) with many cache misses.
+	 * In stress mode, we'll try to drop 64 packets from the flow,
+	 * amortizing this linear lookup to one cache line per drop.
+	 */
+	if (q->drop_policy != FQ_CODEL_DROP_BYTES) {
+		idx = fq_codel_drop_victim(q);
+		maxbacklog = q->backlogs[idx];
+	} else {
+		for (i = 0; i < q->flows_cnt; i++) {
+			if (q->backlogs[i] > maxbacklog) {
+				maxbacklog = q->backlogs[i];
+				idx = i;
+			}
+		}
+	}
+
+	/* Our goal is to drop half of this fat flow backlog */
+	threshold = maxbacklog >> 1;
+
+	flow = &q->flows[idx];
+	len = 0;
+	i = 0;
+	do {
+		skb = dequeue_head(flow);
+		len += qdisc_pkt_len(skb);
+		mem += get_codel_cb(skb)->mem_usage;
+		__qdisc_drop(skb, to_free);
+	} while (++i < max_packets && len < threshold);
+
+	/* Tell codel to increase its signal strength also */
+	flow->cvars.count += i;
+	q->backlogs[idx] -= len;
+	flow->mem_usage -= mem;
+	q->memory_usage -= mem;
+	sch->qstats.drops += i;
+	sch->qstats.backlog -= len;
+	sch->q.qlen -= i;
+	return idx;
+}
+
+static bool fq_codel_flow_overlimit(const struct fq_codel_sched_data *q,
+				    unsigned int idx)
+{
+	return (q->flow_backlog_limit &&
+		q->backlogs[idx] > q->flow_backlog_limit) ||
+	       (q->flow_memory_limit &&
+		q->flows[idx].mem_usage > q->flow_memory_limit);
+}
+
+/* Flow idx went over its own caps: head drop from it until it fits again.
+ * Unlike fq_codel_drop(), the culprit is known, so this is O(1) per drop.
+ */
+static unsigned int fq_codel_flow_trim(struct Qdisc *sch, unsigned int idx,
+				       struct sk_buff **to_free)
+{
+	struct fq_codel_sched_data *q = qdisc_priv(sch);
+	struct fq_codel_flow *flow = &q->flows[idx];
+	unsigned int i = 0, len = 0, mem = 0;
+	struct sk_buff *skb;
+
+	do {
+		skb = dequeue_head(flow);
+		q->backlogs[idx] -= qdisc_pkt_len(skb);
+		flow->mem_usage -= get_codel_cb(skb)->mem_usage;
+		len += qdisc_pkt_len(skb);
+		mem += get_codel_cb(skb)->mem_usage;
+		__qdisc_drop(skb, to_free);
+		i++;
+	} while (flow->head && fq_codel_flow_overlimit(q, idx));
+
+	flow->cvars.count += i;
+	q->memory_usage -= mem;
+	sch->qstats.drops += i;
+	sch->qstats.backlog -= len;
+	sch->q.qlen -= i;
+	return i;
+}
+
+/* Park a flow, already off the DRR lists, until its time_next_packet */
+static void fq_codel_flow_set_throttled(struct fq_codel_sched_data *q,
+					struct fq_codel_flow *flow)
+{
+	struct rb_node **p = &q->delayed.rb_node, *parent = NULL;
+
+	while (*p) {
+		struct fq_codel_flow *aux;
+
+		parent = *p;
+		aux = rb_entry(parent, struct fq_codel_flow, rate_node);
+		if (flow->time_next_packet >= aux->time_next_packet)
+			p = &parent->rb_right;
+		else
+			p = &parent->rb_left;
+	}
+	rb_link_node(&flow->rate_node, parent, p);
+	rb_insert_color(&flow->rate_node, &q->delayed);
+	q->throttled_flows++;
+	q->flows_throttled++;
+	if (q->time_next_delayed_flow > flow->time_next_packet)
+		q->time_next_delayed_flow = flow->time_next_packet;
+}
+
+/* Give the DRR back every flow that became eligible by now */
+static void fq_codel_check_throttled(struct fq_codel_sched_data *q, u64 now)
+{
+	struct rb_node *p;
+
+	if (q->time_next_delayed_flow > now)
+		return;
+
+	q->time_next_delayed_flow = ~0ULL;
+	while ((p = rb_first(&q->delayed)) != NULL) {
+		struct fq_codel_flow *flow;
+
+		flow = rb_entry(p, struct fq_codel_flow, rate_node);
+		if (flow->time_next_packet > now) {
+			q->time_next_delayed_flow = flow->time_next_packet;
+			break;
+		}
+		rb_erase(p, &q->delayed);
+		RB_CLEAR_NODE(p);
+		q->throttled_flows--;
+		list_add_tail(&flow->flowchain, &q->tins[flow->tin].old_flows);
+	}
+}
+
+static void fq_codel_set_auto_quantum(struct fq_codel_sched_data *q)
+{
+	q->quantum = clamp_t(u64, q->link_rate >> FQ_CODEL_QUANTUM_AUTO_SHIFT,
+			     FQ_CODEL_QUANTUM_MIN, FQ_CODEL_QUANTUM_MAX);
+	fq_codel_set_tin_quantum(q);
+}
+
+/* Precompute the per byte transmit time as a fixed point multiplier, with
+ * as many fraction bits as fit below 2^34 so the product with a packet
+ * length never overflows.
+ */
+static void fq_codel_set_shaper_rate(struct fq_codel_sched_data *q, u64 rate)
+{
+	u8 rate_shift = 0;
+	u64 rate_ns = 0;
+
+	if (rate) {
+		rate_shift = 34;
+		rate_ns = div64_u64((u64)NSEC_PER_SEC << rate_shift,
+				    max_t(u64, FQ_CODEL_SHAPER_MIN_RATE, rate));
+		while (rate_ns >> 34) {
+			rate_ns >>= 1;
+			rate_shift--;
+		}
+		q->link_rate = rate;
+	}
+	q->shaper_rate = rate;
+	q->shaper_rate_ns = rate_ns;
+	q->shaper_rate_shift = rate_shift;
+}
+
+/* Start a new filter once the current one is a period old, forgetting
+ * keys older than two periods.
+ */
+static void fq_codel_bloom_rotate(struct fq_codel_sched_data *q)
+{
+	codel_time_t now = codel_get_time();
+
+	if (codel_time_before(now, q->bloom_stamp + q->bloom_period))
+		return;
+	q->bloom_stamp = now;
+	q->bloom_cur ^= 1;
+	bitmap_zero(q->bloom[q->bloom_cur], 1U << q->bloom_shift);
+}
 
-	if (TC_H_MAJ(skb->priority) == sch->handle &&
-	    TC_H_MIN(skb->priority) > 0 &&
-	    TC_H_MIN(skb->priority) <= q->flows_cnt)
-		return TC_H_MIN(skb->priority);
+static void fq_codel_bloom_add(struct fq_codel_sched_data *q, u32 hash)
+{
+	fq_codel_bloom_rotate(q);
+	__set_bit(hash & ((1U << q->bloom_shift) - 1), q->bloom[q->bloom_cur]);
+	__set_bit(hash_32(hash, q->bloom_shift), q->bloom[q->bloom_cur]);
+}
 
-	filter = rcu_dereference_bh(q->filter_list);
-	if (!filter)
-		return fq_codel_cuckoo_hash(q, skb);
+static bool fq_codel_bloom_test(struct fq_codel_sched_data *q, u32 hash)
+{
+	u32 b1 = hash & ((1U << q->bloom_shift) - 1);
+	u32 b2 = hash_32(hash, q->bloom_shift);
+	int i;
 
-	*qerr = NET_XMIT_SUCCESS | __NET_XMIT_BYPASS;
-	result = tcf_classify(skb, filter, &res, false);
-	if (result >= 0) {
-#ifdef CONFIG_NET_CLS_ACT
-		switch (result) {
-		case TC_ACT_STOLEN:
-		case TC_ACT_QUEUED:
-		case TC_ACT_TRAP:
-			*qerr = NET_XMIT_SUCCESS | __NET_XMIT_STOLEN;
-			/* fall through */
-		case TC_ACT_SHOT:
-			return 0;
-		}
-#endif
-		if (TC_H_MIN(res.classid) <= q->flows_cnt)
-			return TC_H_MIN(res.classid);
+	fq_codel_bloom_rotate(q);
+	for (i = 0; i < 2; i++) {
+		if (test_bit(b1, q->bloom[i]) && test_bit(b2, q->bloom[i]))
+			return true;
 	}
-	return 0;
+	return false;
 }
 
-/* helper functions : might be changed when/if skb use a standard list_head */
-
-/* remove one skb from head of slot queue */
-static inline struct sk_buff *dequeue_head(struct fq_codel_flow *flow)
+/* Give back a flow left idle, by dequeue or by a packet which classified to
+ * it but never reached it. A flow with a BLUE probability keeps its key:
+ * an unresponsive flow drained by BLUE would otherwise come back on a fresh
+ * flow at probability 0, and BLUE would ramp up again from scratch.
+ */
+static void fq_codel_release_idle(struct fq_codel_sched_data *q,
+				  unsigned int idx)
 {
-	struct sk_buff *skb = flow->head;
+	struct fq_codel_flow *flow = &q->flows[idx];
 
-	flow->head = skb->next;
-	skb_mark_not_on_list(skb);
-	return skb;
+	if (fq_codel_flow_idle(flow) && !(q->blue && flow->blue_prob))
+		q->index_ops->release(q, idx);
 }
 
-/* add skb to flow queue (tail add) */
-static inline void flow_queue_add(struct fq_codel_flow *flow,
+/* queue one packet (or GSO segment) on flow idx and account for it */
+static void fq_codel_flow_enqueue(struct Qdisc *sch, unsigned int idx,
 				  struct sk_buff *skb)
 {
-	if (flow->head == NULL)
-		flow->head = skb;
-	else
-		flow->tail->next = skb;
-	flow->tail = skb;
-	skb->next = NULL;
+	struct fq_codel_sched_data *q = qdisc_priv(sch);
+
+	codel_set_enqueue_time(skb);
+	if (q->pacing && skb->tstamp) {
+		u64 edt = ktime_to_ns(skb->tstamp);
+		u64 now = ktime_get_ns();
+
+		/* sojourn time starts when the packet is due */
+		if (edt > now && edt - now <= FQ_CODEL_PACING_HORIZON)
+			get_codel_cb(skb)->enqueue_time = edt >> CODEL_SHIFT;
+	}
+	flow_queue_add(&q->flows[idx], skb);
+	q->backlogs[idx] += qdisc_pkt_len(skb);
+	qdisc_qstats_backlog_inc(sch, skb);
+	get_codel_cb(skb)->mem_usage = skb->truesize;
+	q->flows[idx].mem_usage += get_codel_cb(skb)->mem_usage;
+	q->memory_usage += get_codel_cb(skb)->mem_usage;
+	sch->q.qlen++;
 }
 
-static unsigned int fq_codel_drop(struct Qdisc *sch, unsigned int max_packets,
-				  struct sk_buff **to_free)
+/* If the pure ACK skb supersedes one queued on flow idx, let it take the
+ * place (and enqueue time) of the oldest such ACK, which is dropped.
+ * The queue does not grow, so no limit needs to be checked.
+ * Only the ACKs queued after flow->ack_prev are walked: the filter keeps
+ * that run to one ACK per connection, however long the queue is.
+ */
+static bool fq_codel_ack_filter(struct Qdisc *sch, unsigned int idx,
+				struct sk_buff *skb,
+				const struct fq_codel_pure_ack *ack,
+				struct sk_buff **to_free)
 {
 	struct fq_codel_sched_data *q = qdisc_priv(sch);
-	struct sk_buff *skb;
-	unsigned int maxbacklog = 0, idx = 0, i, len;
-	struct fq_codel_flow *flow;
-	unsigned int threshold;
-	unsigned int mem = 0;
-
-	/* Queue is full! Find the fat flow and drop packet(s) from it.
-	 * This might sound expensive, but with 1024 flows, we scan
-	 * 4KB of memory, and we dont need to handle a complex tree
-	 * in fast path (packet queue/enqueue) with many cache misses.
-	 * In stress mode, we'll try to drop 64 packets from the flow,
-	 * amortizing this linear lookup to one cache line per drop.
-	 */
-	for (i = 0; i < q->flows_cnt; i++) {
-		if (q->backlogs[i] > maxbacklog) {
-			maxbacklog = q->backlogs[i];
-			idx = i;
-		}
+	struct fq_codel_flow *flow = &q->flows[idx];
+	struct sk_buff *prev, *cur;
+	struct fq_codel_pure_ack old;
+	unsigned int old_len;
+
+	if (!flow->head)
+		return false;
+
+	prev = flow->ack_prev;
+	for (cur = prev ? prev->next : flow->head; cur;
+	     prev = cur, cur = cur->next) {
+		if (fq_codel_parse_pure_ack(cur, &old) &&
+		    fq_codel_ack_supersedes(ack, &old))
+			break;
 	}
+	if (!cur)
+		return false;
 
-	/* Our goal is to drop half of this fat flow backlog */
-	threshold = maxbacklog >> 1;
+	skb->next = cur->next;
+	if (prev)
+		prev->next = skb;
+	else
+		flow->head = skb;
+	if (flow->tail == cur)
+		flow->tail = skb;
 
-	flow = &q->flows[idx];
-	len = 0;
-	i = 0;
-	do {
-		skb = dequeue_head(flow);
-		len += qdisc_pkt_len(skb);
-		mem += get_codel_cb(skb)->mem_usage;
-		__qdisc_drop(skb, to_free);
-	} while (++i < max_packets && len < threshold);
+	old_len = qdisc_pkt_len(cur);
+	get_codel_cb(skb)->enqueue_time = get_codel_cb(cur)->enqueue_time;
+	get_codel_cb(skb)->mem_usage = skb->truesize;
+	flow->mem_usage += skb->truesize - get_codel_cb(cur)->mem_usage;
+	q->memory_usage += skb->truesize - get_codel_cb(cur)->mem_usage;
+	q->backlogs[idx] += qdisc_pkt_len(skb) - old_len;
+	sch->qstats.backlog += qdisc_pkt_len(skb) - old_len;
 
-	/* Tell codel to increase its signal strength also */
-	flow->cvars.count += i;
-	q->backlogs[idx] -= len;
-	q->memory_usage -= mem;
-	sch->qstats.drops += i;
-	sch->qstats.backlog -= len;
-	sch->q.qlen -= i;
-	return idx;
+	skb_mark_not_on_list(cur);
+	__qdisc_drop(cur, to_free);
+	qdisc_qstats_drop(sch);
+	q->ack_drops++;
+
+	/* our parents saw one more packet, but we hold as many as before */
+	qdisc_tree_reduce_backlog(sch, 1, old_len);
+	return true;
 }
 
 static int fq_codel_enqueue(struct sk_buff *skb, struct Qdisc *sch,
@@ -332,12 +2038,16 @@ static int fq_codel_enqueue(struct sk_buff *skb, struct Qdisc *sch,
 {
 	struct fq_codel_sched_data *q = qdisc_priv(sch);
 	unsigned int idx, prev_backlog, prev_qlen;
+	unsigned int seg_cnt = 0, seg_len = 0;
 	struct fq_codel_flow *flow;
 	int uninitialized_var(ret);
 	unsigned int pkt_len;
-	bool memory_limited;
+	bool memory_limited, flow_limited, activate, recent = false;
+	bool same_flow = false, pure_ack;
+	struct fq_codel_pure_ack ack;
+	u8 weight = 1;
 
-	idx = fq_codel_classify(skb, sch, &ret);
+	idx = fq_codel_classify(skb, sch, &ret, &weight);
 	if (idx == 0) {
 		if (ret & __NET_XMIT_BYPASS)
 			qdisc_qstats_drop(sch);
@@ -346,51 +2056,133 @@ static int fq_codel_enqueue(struct sk_buff *skb, struct Qdisc *sch,
 	}
 	idx--;
 
-	codel_set_enqueue_time(skb);
 	flow = &q->flows[idx];
-	flow_queue_add(flow, skb);
-	q->backlogs[idx] += qdisc_pkt_len(skb);
-	qdisc_qstats_backlog_inc(sch, skb);
+	if (q->blue && flow->blue_prob && prandom_u32() < flow->blue_prob) {
+		q->drop_blue++;
+		fq_codel_release_idle(q, idx);
+		return qdisc_drop(skb, sch, to_free);
+	}
+
+	/* classified once here; GSO segments inherit the cb */
+	fq_codel_skb_cb(skb)->l4s =
+		q->l4s_threshold != CODEL_DISABLED_THRESHOLD &&
+		fq_codel_skb_is_l4s(skb);
+
+	pure_ack = q->ack_filter && fq_codel_parse_pure_ack(skb, &ack);
+	if (pure_ack && fq_codel_ack_filter(sch, idx, skb, &ack, to_free))
+		return NET_XMIT_SUCCESS;
+
+	/* an active flow stays in its tin until it drains */
+	activate = list_empty(&flow->flowchain) &&
+		   !fq_codel_flow_is_throttled(flow);
+	if (activate) {
+		flow->tin = fq_codel_classify_tin(q, skb);
+		flow->weight = weight;
+		/* a bulk flow back from a short pause gets no boost */
+		recent = q->bloom_period &&
+			 fq_codel_bloom_test(q, skb_get_hash(skb));
+	}
+
+	/* save this packet length as our parents accounted it */
+	pkt_len = qdisc_pkt_len(skb);
+	if (skb_is_gso(skb) && q->link_rate &&
+	    q->link_rate < q->split_gso_rate) {
+		netdev_features_t features = netif_skb_features(skb);
+		struct sk_buff *segs, *nskb;
+
+		segs = skb_gso_segment(skb, features & ~NETIF_F_GSO_MASK);
+		if (IS_ERR_OR_NULL(segs)) {
+			fq_codel_release_idle(q, idx);
+			return qdisc_drop(skb, sch, to_free);
+		}
 
-	if (list_empty(&flow->flowchain)) {
-		list_add_tail(&flow->flowchain, &q->new_flows);
+		while (segs) {
+			nskb = segs->next;
+			skb_mark_not_on_list(segs);
+			qdisc_skb_cb(segs)->pkt_len = segs->len;
+			seg_len += segs->len;
+			seg_cnt++;
+			fq_codel_flow_enqueue(sch, idx, segs);
+			segs = nskb;
+		}
+		q->gso_split++;
+		consume_skb(skb);
+	} else {
+		fq_codel_flow_enqueue(sch, idx, skb);
+		seg_len = pkt_len;
+		seg_cnt = 1;
+	}
+	/* anything but a filtered ACK ends the trailing run of ACKs */
+	if (!pure_ack)
+		flow->ack_prev = flow->tail;
+
+	if (activate && recent) {
+		list_add_tail(&flow->flowchain, &q->tins[flow->tin].old_flows);
+		q->bloom_denied++;
+		flow->deficit = fq_codel_flow_quantum(q, flow);
+	} else if (activate) {
+		list_add_tail(&flow->flowchain, &q->tins[flow->tin].new_flows);
 		q->new_flow_count++;
-		flow->deficit = q->quantum;
+		flow->deficit = fq_codel_flow_quantum(q, flow);
 	}
-	get_codel_cb(skb)->mem_usage = skb->truesize;
-	q->memory_usage += get_codel_cb(skb)->mem_usage;
+	flow_limited = fq_codel_flow_overlimit(q, idx);
 	memory_limited = q->memory_usage > q->memory_limit;
-	if (++sch->q.qlen <= sch->limit && !memory_limited)
+	if (!flow_limited && sch->q.qlen <= sch->limit && !memory_limited) {
+		/* our parents saw one packet of pkt_len bytes */
+		if (seg_cnt > 1)
+			qdisc_tree_reduce_backlog(sch, 1 - seg_cnt,
+						  pkt_len - seg_len);
 		return NET_XMIT_SUCCESS;
+	}
 
 	prev_backlog = sch->qstats.backlog;
 	prev_qlen = sch->q.qlen;
 
-	/* save this packet length as it might be dropped by fq_codel_drop() */
-	pkt_len = qdisc_pkt_len(skb);
-	/* fq_codel_drop() is quite expensive, as it performs a linear search
-	 * in q->backlogs[] to find a fat flow.
-	 * So instead of dropping a single packet, drop half of its backlog
-	 * with a 64 packets limit to not add a too big cpu spike here.
-	 */
-	ret = fq_codel_drop(sch, q->drop_batch_size, to_free);
+	if (flow_limited) {
+		q->drop_flow_limit += fq_codel_flow_trim(sch, idx, to_free);
+		memory_limited = q->memory_usage > q->memory_limit;
+		same_flow = true;
+		if (q->blue)
+			fq_codel_blue_queue_full(q, flow);
+	}
+
+	if (sch->q.qlen > sch->limit || memory_limited) {
+		unsigned int qlen = sch->q.qlen;
+		unsigned int fat;
+
+		/* fq_codel_drop() is quite expensive, as it performs a linear
+		 * search in q->backlogs[] to find a fat flow.
+		 * So instead of dropping a single packet, drop half of its
+		 * backlog with a 64 packets limit to not add a too big cpu
+		 * spike here.
+		 */
+		fat = fq_codel_drop(sch, q->drop_batch_size, to_free);
+		if (fat == idx)
+			same_flow = true;
+		/* whoever triggered the overflow, the fat flow caused it */
+		if (q->blue)
+			fq_codel_blue_queue_full(q, &q->flows[fat]);
+
+		qlen -= sch->q.qlen;
+		q->drop_overlimit += qlen;
+		if (memory_limited)
+			q->drop_overmemory += qlen;
+	}
 
 	prev_qlen -= sch->q.qlen;
 	prev_backlog -= sch->qstats.backlog;
-	q->drop_overlimit += prev_qlen;
-	if (memory_limited)
-		q->drop_overmemory += prev_qlen;
 
 	/* As we dropped packet(s), better let upper stack know this.
 	 * If we dropped a packet for this flow, return NET_XMIT_CN,
 	 * but in this case, our parents wont increase their backlogs.
 	 */
-	if (ret == idx) {
-		qdisc_tree_reduce_backlog(sch, prev_qlen - 1,
-					  prev_backlog - pkt_len);
+	if (same_flow) {
+		qdisc_tree_reduce_backlog(sch, prev_qlen - seg_cnt,
+					  prev_backlog - seg_len);
 		return NET_XMIT_CN;
 	}
-	qdisc_tree_reduce_backlog(sch, prev_qlen, prev_backlog);
+	qdisc_tree_reduce_backlog(sch, prev_qlen + 1 - seg_cnt,
+				  prev_backlog + pkt_len - seg_len);
 	return NET_XMIT_SUCCESS;
 }
 
@@ -409,6 +2201,7 @@ static struct sk_buff *dequeue_func(struct codel_vars *vars, void *ctx)
 	if (flow->head) {
 		skb = dequeue_head(flow);
 		q->backlogs[flow - q->flows] -= qdisc_pkt_len(skb);
+		flow->mem_usage -= get_codel_cb(skb)->mem_usage;
 		q->memory_usage -= get_codel_cb(skb)->mem_usage;
 		sch->q.qlen--;
 		sch->qstats.backlog -= qdisc_pkt_len(skb);
@@ -424,42 +2217,228 @@ static void drop_func(struct sk_buff *skb, void *ctx)
 	qdisc_qstats_drop(sch);
 }
 
+/* Sample the dequeue rate over windows of at least FQ_CODEL_RATE_WINDOW
+ * during which the qdisc never ran empty, smoothed by a 1/8 EWMA.
+ */
+static void fq_codel_rate_update(struct fq_codel_sched_data *q,
+				 const struct sk_buff *skb)
+{
+	u64 now = ktime_get_ns();
+	u64 rate, delta;
+
+	if (!q->rate_stamp) {
+		q->rate_stamp = now;
+		q->rate_bytes = 0;
+		return;
+	}
+	q->rate_bytes += qdisc_pkt_len(skb);
+	delta = now - q->rate_stamp;
+	if (delta < FQ_CODEL_RATE_WINDOW)
+		return;
+
+	rate = div64_u64(q->rate_bytes * NSEC_PER_SEC, delta);
+	if (q->link_rate)
+		q->link_rate += (s64)(rate - q->link_rate) >> 3;
+	else
+		q->link_rate = rate;
+	q->rate_stamp = now;
+	q->rate_bytes = 0;
+
+	if (q->quantum_auto)
+		fq_codel_set_auto_quantum(q);
+}
+
+/* Per flow counterpart of fq_codel_rate_update(). The sample spans the
+ * time the flow was idle too, so a flow that stops sending decays at its
+ * next packet; until then its estimate is left as it was.
+ */
+static void fq_codel_flow_rate_update(struct fq_codel_flow *flow,
+				      const struct sk_buff *skb,
+				      codel_time_t now)
+{
+	u32 delta;
+	u64 bps, pps;
+
+	flow->rate_bytes += qdisc_pkt_len(skb);
+	flow->rate_packets++;
+	if (!flow->rate_stamp) {
+		flow->rate_stamp = now ?: 1;
+		return;
+	}
+	delta = now - flow->rate_stamp;
+	if (delta < FQ_CODEL_FLOW_RATE_WINDOW)
+		return;
+
+	bps = div_u64((u64)flow->rate_bytes * (NSEC_PER_SEC >> CODEL_SHIFT),
+		      delta);
+	pps = div_u64((u64)flow->rate_packets * (NSEC_PER_SEC >> CODEL_SHIFT),
+		      delta);
+	bps = min_t(u64, bps, U32_MAX);
+	pps = min_t(u64, pps, U32_MAX);
+	if (flow->rate_bps || flow->rate_pps) {
+		flow->rate_bps += ((s64)bps - flow->rate_bps) >> 3;
+		flow->rate_pps += ((s64)pps - flow->rate_pps) >> 3;
+	} else {
+		flow->rate_bps = bps;
+		flow->rate_pps = pps;
+	}
+	flow->rate_stamp = now ?: 1;
+	flow->rate_bytes = 0;
+	flow->rate_packets = 0;
+}
+
+/* Charge a sent packet to the shaper clock. An idle period only earns up
+ * to FQ_CODEL_SHAPER_BURST of credit.
+ */
+static void fq_codel_shaper_charge(struct fq_codel_sched_data *q,
+				   const struct sk_buff *skb, u64 now)
+{
+	u32 len = max_t(s32, 1, (s32)qdisc_pkt_len(skb) + q->shaper_overhead);
+
+	q->time_next_packet = max(q->time_next_packet,
+				  now - FQ_CODEL_SHAPER_BURST);
+	q->time_next_packet += (len * q->shaper_rate_ns) >> q->shaper_rate_shift;
+}
+
+/* L4S head packet: no CoDel state machine, just a step CE mark on the
+ * packet's own sojourn time.
+ */
+static struct sk_buff *fq_codel_dequeue_l4s(struct Qdisc *sch,
+					    struct fq_codel_flow *flow)
+{
+	struct fq_codel_sched_data *q = qdisc_priv(sch);
+	struct sk_buff *skb = dequeue_func(&flow->cvars, sch);
+	codel_time_t sojourn = codel_get_time() - codel_get_enqueue_time(skb);
+
+	flow->cvars.ldelay = sojourn;
+	q->l4s_packets++;
+	if (codel_time_after(sojourn, q->l4s_threshold) && INET_ECN_set_ce(skb))
+		q->l4s_ce_mark++;
+	return skb;
+}
+
+/* A whole DRR round went by without any old flow earning a positive
+ * deficit. Rather than rotating old_flows again and again, credit every
+ * flow at once with the number of rounds all of them still need: the list
+ * order stays what that many full rotations would have left.
+ */
+static void fq_codel_skip_rounds(struct fq_codel_sched_data *q,
+				 struct fq_codel_tin *tin)
+{
+	struct fq_codel_flow *flow;
+	u32 rounds = U32_MAX;
+
+	list_for_each_entry(flow, &tin->old_flows, flowchain) {
+		if (flow->deficit > 0)
+			return;
+		rounds = min_t(u32, rounds, (u32)-flow->deficit /
+					    fq_codel_flow_quantum(q, flow));
+	}
+	if (!rounds)
+		return;
+
+	list_for_each_entry(flow, &tin->old_flows, flowchain)
+		flow->deficit += rounds * fq_codel_flow_quantum(q, flow);
+}
+
 static struct sk_buff *fq_codel_dequeue(struct Qdisc *sch)
 {
 	struct fq_codel_sched_data *q = qdisc_priv(sch);
+	struct fq_codel_flow *first_skipped = NULL;
+	struct fq_codel_tin *tin, *cur_tin = NULL;
 	struct sk_buff *skb;
 	struct fq_codel_flow *flow;
 	struct list_head *head;
+	u64 now = 0;
+
+	if (q->pacing || q->shaper_rate)
+		now = ktime_get_ns();
+	if (q->pacing)
+		fq_codel_check_throttled(q, now);
+
+	if (q->shaper_rate && q->time_next_packet > now && sch->q.qlen) {
+		qdisc_watchdog_schedule_ns(&q->watchdog, q->time_next_packet);
+		qdisc_qstats_overlimit(sch);
+		return NULL;
+	}
 
 begin:
-	head = &q->new_flows;
-	if (list_empty(head)) {
-		head = &q->old_flows;
-		if (list_empty(head))
-			return NULL;
+	tin = fq_codel_select_tin(q);
+	if (!tin) {
+		/* idle time must not dilute the rate sample */
+		q->rate_stamp = 0;
+		if (!RB_EMPTY_ROOT(&q->delayed))
+			qdisc_watchdog_schedule_ns(&q->watchdog,
+						   q->time_next_delayed_flow);
+		return NULL;
+	}
+	if (tin != cur_tin) {
+		cur_tin = tin;
+		first_skipped = NULL;
 	}
+	head = &tin->new_flows;
+	if (list_empty(head))
+		head = &tin->old_flows;
 	flow = list_first_entry(head, struct fq_codel_flow, flowchain);
 
 	if (flow->deficit <= 0) {
-		flow->deficit += q->quantum;
-		list_move_tail(&flow->flowchain, &q->old_flows);
+		/* back to the first flow we skipped: nobody could send */
+		if (flow == first_skipped && head == &tin->old_flows)
+			fq_codel_skip_rounds(q, tin);
+		else if (!first_skipped)
+			first_skipped = flow;
+		if (q->bloom_period && head == &tin->new_flows && flow->head)
+			fq_codel_bloom_add(q, skb_get_hash(flow->head));
+		flow->deficit += fq_codel_flow_quantum(q, flow);
+		list_move_tail(&flow->flowchain, &tin->old_flows);
 		goto begin;
 	}
 
-	skb = codel_dequeue(sch, &sch->qstats.backlog, &q->cparams,
-			    &flow->cvars, &q->cstats, qdisc_pkt_len,
-			    codel_get_enqueue_time, drop_func, dequeue_func);
+	if (q->pacing && flow->head) {
+		u64 edt = ktime_to_ns(flow->head->tstamp);
+
+		if (edt > now && edt - now <= FQ_CODEL_PACING_HORIZON) {
+			flow->time_next_packet = edt;
+			list_del_init(&flow->flowchain);
+			fq_codel_flow_set_throttled(q, flow);
+			goto begin;
+		}
+	}
+
+	if (q->l4s_threshold != CODEL_DISABLED_THRESHOLD && flow->head &&
+	    fq_codel_skb_cb(flow->head)->l4s) {
+		skb = fq_codel_dequeue_l4s(sch, flow);
+	} else {
+		skb = codel_dequeue(sch, &sch->qstats.backlog, &q->cparams,
+				    &flow->cvars, &q->cstats, qdisc_pkt_len,
+				    codel_get_enqueue_time, drop_func,
+				    dequeue_func);
+		if (skb)
+			q->classic_packets++;
+	}
 
 	if (!skb) {
+		if (q->blue)
+			fq_codel_blue_queue_empty(q, flow);
 		/* force a pass through old_flows to prevent starvation */
-		if ((head == &q->new_flows) && !list_empty(&q->old_flows))
-			list_move_tail(&flow->flowchain, &q->old_flows);
-		else
+		if ((head == &tin->new_flows) && !list_empty(&tin->old_flows)) {
+			list_move_tail(&flow->flowchain, &tin->old_flows);
+		} else {
 			list_del_init(&flow->flowchain);
+			fq_codel_release_idle(q, flow - q->flows);
+		}
 		goto begin;
 	}
 	qdisc_bstats_update(sch, skb);
+	fq_codel_flow_rate_update(flow, skb, codel_get_time());
 	flow->deficit -= qdisc_pkt_len(skb);
+	if (q->tin_cnt > 1)
+		tin->deficit -= qdisc_pkt_len(skb);
+	tin->packets++;
+	if (q->shaper_rate)
+		fq_codel_shaper_charge(q, skb, now);
+	else if (q->split_gso_rate || q->quantum_auto)
+		fq_codel_rate_update(q, skb);
 	/* We cant call qdisc_tree_reduce_backlog() if our qlen is 0,
 	 * or HTB crashes. Defer it for next round.
 	 */
@@ -476,31 +2455,60 @@ static void fq_codel_flow_purge(struct fq_codel_flow *flow)
 {
 	rtnl_kfree_skbs(flow->head, flow->tail);
 	flow->head = NULL;
+	flow->ack_prev = NULL;
+}
+
+static void fq_codel_flow_reset(struct fq_codel_sched_data *q,
+				struct fq_codel_flow *flow)
+{
+	fq_codel_flow_purge(flow);
+	INIT_LIST_HEAD(&flow->flowchain);
+	RB_CLEAR_NODE(&flow->rate_node);
+	codel_vars_init(&flow->cvars);
+	flow->mem_usage = 0;
+	flow->blue_prob = 0;
+	flow->weight = 1;
+	fq_codel_flow_rate_reset(flow);
+	q->backlogs[flow - q->flows] = 0;
 }
 
+/* Every flow holding packets sits on a tin list or in the delayed tree, so
+ * only those are walked. Idle flows keep their soft state (CoDel, BLUE and
+ * rate), which a table index clears anyway when it maps them again.
+ */
 static void fq_codel_reset(struct Qdisc *sch)
 {
 	struct fq_codel_sched_data *q = qdisc_priv(sch);
+	struct fq_codel_flow *flow, *next;
+	struct rb_node *p;
 	int i;
 
-	INIT_LIST_HEAD(&q->new_flows);
-	INIT_LIST_HEAD(&q->old_flows);
-	for (i = 0; i < q->flows_cnt; i++) {
-		struct fq_codel_flow *flow = q->flows + i;
+	for (i = 0; i < FQ_CODEL_MAX_TINS; i++) {
+		struct fq_codel_tin *tin = &q->tins[i];
 
-		fq_codel_flow_purge(flow);
-		INIT_LIST_HEAD(&flow->flowchain);
-		codel_vars_init(&flow->cvars);
+		list_for_each_entry_safe(flow, next, &tin->new_flows, flowchain)
+			fq_codel_flow_reset(q, flow);
+		list_for_each_entry_safe(flow, next, &tin->old_flows, flowchain)
+			fq_codel_flow_reset(q, flow);
+		INIT_LIST_HEAD(&tin->new_flows);
+		INIT_LIST_HEAD(&tin->old_flows);
+		tin->deficit = tin->quantum;
+	}
+	while ((p = rb_first(&q->delayed)) != NULL) {
+		flow = rb_entry(p, struct fq_codel_flow, rate_node);
+		rb_erase(p, &q->delayed);
+		fq_codel_flow_reset(q, flow);
 	}
-	memset(q->backlogs, 0, q->flows_cnt * sizeof(u32));
-	// $$
-    memset(q->hashtable, 0, 2 * q->flows_cnt * sizeof(u16));
+	q->time_next_delayed_flow = ~0ULL;
+	q->throttled_flows = 0;
+	qdisc_watchdog_cancel(&q->watchdog);
+	q->index_ops->reset(q);
 	sch->q.qlen = 0;
 	sch->qstats.backlog = 0;
 	q->memory_usage = 0;
 }
 
-static const struct nla_policy fq_codel_policy[TCA_FQ_CODEL_MAX + 1] = {
+static const struct nla_policy fq_codel_policy[TCA_FQ_CODEL_CUCKOO_MAX + 1] = {
 	[TCA_FQ_CODEL_TARGET]	= { .type = NLA_U32 },
 	[TCA_FQ_CODEL_LIMIT]	= { .type = NLA_U32 },
 	[TCA_FQ_CODEL_INTERVAL]	= { .type = NLA_U32 },
@@ -510,19 +2518,56 @@ static const struct nla_policy fq_codel_policy[TCA_FQ_CODEL_MAX + 1] = {
 	[TCA_FQ_CODEL_CE_THRESHOLD] = { .type = NLA_U32 },
 	[TCA_FQ_CODEL_DROP_BATCH_SIZE] = { .type = NLA_U32 },
 	[TCA_FQ_CODEL_MEMORY_LIMIT] = { .type = NLA_U32 },
+	[TCA_FQ_CODEL_BLUE]	= { .type = NLA_U32 },
+	[TCA_FQ_CODEL_L4S_THRESHOLD] = { .type = NLA_U32 },
+	[TCA_FQ_CODEL_SPLIT_GSO_RATE] = { .type = NLA_U64 },
+	[TCA_FQ_CODEL_ACK_FILTER] = { .type = NLA_U32 },
+	[TCA_FQ_CODEL_FLOW_BACKLOG_LIMIT] = { .type = NLA_U32 },
+	[TCA_FQ_CODEL_FLOW_MEMORY_LIMIT] = { .type = NLA_U32 },
+	[TCA_FQ_CODEL_QUANTUM_AUTO] = { .type = NLA_U32 },
+	[TCA_FQ_CODEL_PACING]	= { .type = NLA_U32 },
+	[TCA_FQ_CODEL_DIFFSERV]	= { .type = NLA_U32 },
+	[TCA_FQ_CODEL_RATE]	= { .type = NLA_U64 },
+	[TCA_FQ_CODEL_OVERHEAD]	= { .type = NLA_S32 },
+	[TCA_FQ_CODEL_INDEX]	= { .type = NLA_U32 },
+	[TCA_FQ_CODEL_INDEX_SLOTS] = { .type = NLA_U32 },
+	[TCA_FQ_CODEL_EXHAUST_POLICY] = { .type = NLA_U32 },
+	[TCA_FQ_CODEL_OVERFLOW_FLOWS] = { .type = NLA_U32 },
+	[TCA_FQ_CODEL_NEW_FLOW_RATE] = { .type = NLA_U32 },
+	[TCA_FQ_CODEL_NEW_FLOW_BURST] = { .type = NLA_U32 },
+	[TCA_FQ_CODEL_BLOOM]	= { .type = NLA_U32 },
+	[TCA_FQ_CODEL_CLASSID_INDEX] = { .type = NLA_U32 },
+	[TCA_FQ_CODEL_WEIGHTS]	= { .type = NLA_U32 },
+	[TCA_FQ_CODEL_DROP_POLICY] = { .type = NLA_U32 },
 };
 
+/* A bypassed packet goes straight to the device: it is never charged to
+ * the shaper clock and its departure time is not honoured, so an idle
+ * shaped or pacing qdisc must not allow bypass.
+ */
+static void fq_codel_update_bypass(struct Qdisc *sch)
+{
+	const struct fq_codel_sched_data *q = qdisc_priv(sch);
+
+	if (sch->limit >= 1 && !q->shaper_rate && !q->pacing)
+		sch->flags |= TCQ_F_CAN_BYPASS;
+	else
+		sch->flags &= ~TCQ_F_CAN_BYPASS;
+}
+
 static int fq_codel_change(struct Qdisc *sch, struct nlattr *opt,
 			   struct netlink_ext_ack *extack)
 {
 	struct fq_codel_sched_data *q = qdisc_priv(sch);
-	struct nlattr *tb[TCA_FQ_CODEL_MAX + 1];
+	struct nlattr *tb[TCA_FQ_CODEL_CUCKOO_MAX + 1];
+	unsigned int prev_qlen, prev_backlog;
+	struct sk_buff *to_free = NULL;
 	int err;
 
 	if (!opt)
 		return -EINVAL;
 
-	err = nla_parse_nested_deprecated(tb, TCA_FQ_CODEL_MAX, opt,
+	err = nla_parse_nested_deprecated(tb, TCA_FQ_CODEL_CUCKOO_MAX, opt,
 					  fq_codel_policy, NULL);
 	if (err < 0)
 		return err;
@@ -531,8 +2576,63 @@ static int fq_codel_change(struct Qdisc *sch, struct nlattr *opt,
 			return -EINVAL;
 		q->flows_cnt = nla_get_u32(tb[TCA_FQ_CODEL_FLOWS]);
 		if (!q->flows_cnt ||
-		    q->flows_cnt > 65536)
+		    q->flows_cnt > FQ_CODEL_MAX_FLOWS)
+			return -EINVAL;
+	}
+	if (tb[TCA_FQ_CODEL_DIFFSERV]) {
+		u32 tin_cnt = nla_get_u32(tb[TCA_FQ_CODEL_DIFFSERV]);
+
+		if (tin_cnt != 1 && tin_cnt != 3 && tin_cnt != 4)
+			return -EINVAL;
+		/* flows sit on tin lists: no remapping once running */
+		if (q->flows && tin_cnt != q->tin_cnt)
 			return -EINVAL;
+		q->tin_cnt = tin_cnt;
+	}
+	if (tb[TCA_FQ_CODEL_INDEX]) {
+		u32 type = nla_get_u32(tb[TCA_FQ_CODEL_INDEX]);
+
+		if (type >= FQ_CODEL_INDEX_MAX)
+			return -EINVAL;
+		if (q->flows && type != q->index_type)
+			return -EINVAL;
+		q->index_type = type;
+		q->index_ops = &fq_codel_index_backends[type];
+	}
+	if (tb[TCA_FQ_CODEL_OVERFLOW_FLOWS]) {
+		u32 cnt = nla_get_u32(tb[TCA_FQ_CODEL_OVERFLOW_FLOWS]);
+
+		if (cnt >= q->flows_cnt || (q->flows && cnt != q->overflow_cnt))
+			return -EINVAL;
+		q->overflow_cnt = cnt;
+	}
+	if (tb[TCA_FQ_CODEL_EXHAUST_POLICY]) {
+		u32 policy = nla_get_u32(tb[TCA_FQ_CODEL_EXHAUST_POLICY]);
+
+		if (policy >= FQ_CODEL_EXHAUST_MAX)
+			return -EINVAL;
+		q->exhaust_policy = policy;
+	}
+	if (tb[TCA_FQ_CODEL_DROP_POLICY]) {
+		u32 policy = nla_get_u32(tb[TCA_FQ_CODEL_DROP_POLICY]);
+
+		if (policy >= FQ_CODEL_DROP_MAX)
+			return -EINVAL;
+		q->drop_policy = policy;
+	}
+	if (tb[TCA_FQ_CODEL_INDEX_SLOTS]) {
+		u32 slots = nla_get_u32(tb[TCA_FQ_CODEL_INDEX_SLOTS]);
+
+		if (slots < max_t(u32, q->flows_cnt, FQ_CODEL_INDEX_MIN_SLOTS) ||
+		    slots > FQ_CODEL_INDEX_MAX_SLOTS)
+			return -EINVAL;
+		if (!q->flows) {
+			q->index_slots = slots;
+		} else if (slots != q->index_slots) {
+			err = q->index_ops->resize(sch, slots);
+			if (err)
+				return err;
+		}
 	}
 	sch_tree_lock(sch);
 
@@ -548,6 +2648,12 @@ static int fq_codel_change(struct Qdisc *sch, struct nlattr *opt,
 		q->cparams.ce_threshold = (val * NSEC_PER_USEC) >> CODEL_SHIFT;
 	}
 
+	if (tb[TCA_FQ_CODEL_L4S_THRESHOLD]) {
+		u64 val = nla_get_u32(tb[TCA_FQ_CODEL_L4S_THRESHOLD]);
+
+		q->l4s_threshold = (val * NSEC_PER_USEC) >> CODEL_SHIFT;
+	}
+
 	if (tb[TCA_FQ_CODEL_INTERVAL]) {
 		u64 interval = nla_get_u32(tb[TCA_FQ_CODEL_INTERVAL]);
 
@@ -562,6 +2668,11 @@ static int fq_codel_change(struct Qdisc *sch, struct nlattr *opt,
 
 	if (tb[TCA_FQ_CODEL_QUANTUM])
 		q->quantum = max(256U, nla_get_u32(tb[TCA_FQ_CODEL_QUANTUM]));
+	fq_codel_set_tin_quantum(q);
+
+	/* an explicit quantum stays in use until the first rate sample */
+	if (tb[TCA_FQ_CODEL_QUANTUM_AUTO])
+		q->quantum_auto = !!nla_get_u32(tb[TCA_FQ_CODEL_QUANTUM_AUTO]);
 
 	if (tb[TCA_FQ_CODEL_DROP_BATCH_SIZE])
 		q->drop_batch_size = min(1U, nla_get_u32(tb[TCA_FQ_CODEL_DROP_BATCH_SIZE]));
@@ -569,19 +2680,87 @@ static int fq_codel_change(struct Qdisc *sch, struct nlattr *opt,
 	if (tb[TCA_FQ_CODEL_MEMORY_LIMIT])
 		q->memory_limit = min(1U << 31, nla_get_u32(tb[TCA_FQ_CODEL_MEMORY_LIMIT]));
 
-	while (sch->q.qlen > sch->limit ||
-	       q->memory_usage > q->memory_limit) {
-		struct sk_buff *skb = fq_codel_dequeue(sch);
+	if (tb[TCA_FQ_CODEL_FLOW_BACKLOG_LIMIT])
+		q->flow_backlog_limit = nla_get_u32(tb[TCA_FQ_CODEL_FLOW_BACKLOG_LIMIT]);
+
+	if (tb[TCA_FQ_CODEL_FLOW_MEMORY_LIMIT])
+		q->flow_memory_limit = nla_get_u32(tb[TCA_FQ_CODEL_FLOW_MEMORY_LIMIT]);
+
+	if (tb[TCA_FQ_CODEL_BLUE])
+		q->blue = !!nla_get_u32(tb[TCA_FQ_CODEL_BLUE]);
+
+	if (tb[TCA_FQ_CODEL_SPLIT_GSO_RATE])
+		q->split_gso_rate = nla_get_u64(tb[TCA_FQ_CODEL_SPLIT_GSO_RATE]);
+
+	if (tb[TCA_FQ_CODEL_ACK_FILTER])
+		q->ack_filter = !!nla_get_u32(tb[TCA_FQ_CODEL_ACK_FILTER]);
+
+	if (tb[TCA_FQ_CODEL_OVERHEAD])
+		q->shaper_overhead = nla_get_s32(tb[TCA_FQ_CODEL_OVERHEAD]);
+
+	if (tb[TCA_FQ_CODEL_RATE]) {
+		fq_codel_set_shaper_rate(q, nla_get_u64(tb[TCA_FQ_CODEL_RATE]));
+		if (q->shaper_rate && q->quantum_auto)
+			fq_codel_set_auto_quantum(q);
+	}
+
+	if (tb[TCA_FQ_CODEL_CLASSID_INDEX])
+		q->classid_index = !!nla_get_u32(tb[TCA_FQ_CODEL_CLASSID_INDEX]);
+
+	if (tb[TCA_FQ_CODEL_WEIGHTS])
+		q->weights = !!nla_get_u32(tb[TCA_FQ_CODEL_WEIGHTS]);
+
+	if (tb[TCA_FQ_CODEL_BLOOM]) {
+		u64 period = nla_get_u32(tb[TCA_FQ_CODEL_BLOOM]);
 
-		q->cstats.drop_len += qdisc_pkt_len(skb);
-		rtnl_kfree_skbs(skb, skb);
-		q->cstats.drop_count++;
+		q->bloom_period = (period * NSEC_PER_USEC) >> CODEL_SHIFT;
+		q->bloom_stamp = codel_get_time();
+		/* allocated zeroed by init */
+		if (q->bloom[0]) {
+			bitmap_zero(q->bloom[0], 1U << q->bloom_shift);
+			bitmap_zero(q->bloom[1], 1U << q->bloom_shift);
+		}
+	}
+
+	if (tb[TCA_FQ_CODEL_NEW_FLOW_BURST])
+		q->new_flow_burst = max(1U, nla_get_u32(tb[TCA_FQ_CODEL_NEW_FLOW_BURST]));
+
+	if (tb[TCA_FQ_CODEL_NEW_FLOW_RATE]) {
+		q->new_flow_rate = nla_get_u32(tb[TCA_FQ_CODEL_NEW_FLOW_RATE]);
+		/* start with a full bucket */
+		if (q->new_flow_rate)
+			q->new_flow_tokens = q->new_flow_burst *
+					     div_u64(NSEC_PER_SEC, q->new_flow_rate);
+		q->new_flow_stamp = ktime_get_ns();
+	}
+
+	if (tb[TCA_FQ_CODEL_PACING]) {
+		q->pacing = !!nla_get_u32(tb[TCA_FQ_CODEL_PACING]);
+		/* hand back any flow still waiting for its departure time */
+		if (!q->pacing)
+			fq_codel_check_throttled(q, ~0ULL);
+	}
+	fq_codel_update_bypass(sch);
+
+	/* Trim the fat flows directly rather than dequeueing through CoDel
+	 * and DRR, and only free the packets once the lock is released.
+	 */
+	prev_qlen = sch->q.qlen;
+	prev_backlog = sch->qstats.backlog;
+	while (sch->q.qlen && (sch->q.qlen > sch->limit ||
+			       q->memory_usage > q->memory_limit)) {
+		unsigned int max_packets = q->drop_batch_size;
+
+		if (q->memory_usage <= q->memory_limit)
+			max_packets = min(max_packets,
+					  sch->q.qlen - sch->limit);
+		fq_codel_drop(sch, max_packets, &to_free);
 	}
-	qdisc_tree_reduce_backlog(sch, q->cstats.drop_count, q->cstats.drop_len);
-	q->cstats.drop_count = 0;
-	q->cstats.drop_len = 0;
+	qdisc_tree_reduce_backlog(sch, prev_qlen - sch->q.qlen,
+				  prev_backlog - sch->qstats.backlog);
 
 	sch_tree_unlock(sch);
+	kfree_skb_list(to_free);
 	return 0;
 }
 
@@ -590,8 +2769,62 @@ static void fq_codel_destroy(struct Qdisc *sch)
 	struct fq_codel_sched_data *q = qdisc_priv(sch);
 
 	tcf_block_put(q->block);
-	kvfree(q->backlogs);
-	kvfree(q->flows);
+	qdisc_watchdog_cancel(&q->watchdog);
+	kvfree(q->index_mem);
+	kvfree(q->arena);
+	if (q->npow2)
+		static_branch_dec(&fq_codel_npow2);
+}
+
+/* Everything sized by flows_cnt and index_slots comes from one allocation,
+ * each array on its own cache lines: the backlogs scanned for the fat flow
+ * follow the flows, and the index follows the free flow bitmap that
+ * inserts consult with it. The Bloom filters, only touched on activation
+ * and demotion, come last.
+ */
+static int fq_codel_arena_alloc(struct fq_codel_sched_data *q)
+{
+	const struct fq_codel_index_ops *ops = q->index_ops;
+	size_t flows, backlogs, mask, table, bloom;
+	u32 slots;
+	void *mem;
+
+	slots = fq_codel_table_slots(ops, q->index_slots);
+	flows = ALIGN(q->flows_cnt * sizeof(struct fq_codel_flow),
+		      SMP_CACHE_BYTES);
+	backlogs = ALIGN(q->flows_cnt * sizeof(u32), SMP_CACHE_BYTES);
+	mask = ALIGN(BITS_TO_LONGS(q->flows_cnt) * sizeof(unsigned long),
+		     SMP_CACHE_BYTES);
+	q->bloom_shift = max(order_base_2(q->flows_cnt) +
+			     FQ_CODEL_BLOOM_FLOW_SHIFT,
+			     FQ_CODEL_BLOOM_MIN_SHIFT);
+	bloom = ALIGN(BITS_TO_LONGS(1U << q->bloom_shift) *
+		      sizeof(unsigned long), SMP_CACHE_BYTES);
+
+	q->index_width = fq_codel_index_width(q->flows_cnt);
+	table = fq_codel_table_size(ops, slots, q->index_width);
+	q->arena = kvzalloc(flows + backlogs + mask + table + 2 * bloom +
+			    SMP_CACHE_BYTES - 1, GFP_KERNEL);
+	if (!q->arena)
+		return -ENOMEM;
+
+	mem = PTR_ALIGN(q->arena, SMP_CACHE_BYTES);
+	q->flows = mem;
+	q->backlogs = mem + flows;
+	q->empty_flow_mask = mem + flows + backlogs;
+	fq_codel_table_carve(ops, mem + flows + backlogs + mask, slots,
+			     q->index_width, &q->index, &q->index_aux,
+			     &q->index_tags);
+	q->bloom[0] = mem + flows + backlogs + mask + table;
+	q->bloom[1] = mem + flows + backlogs + mask + table + bloom;
+	if (slots)
+		q->index_slots = slots;
+	q->index_range = fq_codel_table_range(ops, slots);
+	q->index_shift = fq_codel_pow2_shift(q->index_range);
+	q->flows_shift = fq_codel_pow2_shift(q->flows_cnt);
+	fq_codel_pow2_check(q, q->index_range);
+	fq_codel_pow2_check(q, q->flows_cnt);
+	return 0;
 }
 
 static int fq_codel_init(struct Qdisc *sch, struct nlattr *opt,
@@ -606,73 +2839,64 @@ static int fq_codel_init(struct Qdisc *sch, struct nlattr *opt,
 	q->memory_limit = 32 << 20; /* 32 MBytes */
 	q->drop_batch_size = 64;
 	q->quantum = psched_mtu(qdisc_dev(sch));
-	INIT_LIST_HEAD(&q->new_flows);
-	INIT_LIST_HEAD(&q->old_flows);
+	q->tin_cnt = 1;
+	for (i = 0; i < FQ_CODEL_MAX_TINS; i++) {
+		INIT_LIST_HEAD(&q->tins[i].new_flows);
+		INIT_LIST_HEAD(&q->tins[i].old_flows);
+	}
+	q->delayed = RB_ROOT;
+	q->time_next_delayed_flow = ~0ULL;
+	qdisc_watchdog_init(&q->watchdog, sch);
 	codel_params_init(&q->cparams);
 	codel_stats_init(&q->cstats);
 	q->cparams.ecn = true;
 	q->cparams.mtu = psched_mtu(qdisc_dev(sch));
+	q->l4s_threshold = CODEL_DISABLED_THRESHOLD;
+	q->index_type = FQ_CODEL_INDEX_CUCKOO;
+	q->index_ops = &fq_codel_index_backends[q->index_type];
+	q->new_flow_burst = FQ_CODEL_NEW_FLOW_BURST;
 
 	if (opt) {
 		err = fq_codel_change(sch, opt, extack);
 		if (err)
 			goto init_failure;
 	}
+	fq_codel_set_tin_quantum(q);
+	for (i = 0; i < q->tin_cnt; i++)
+		q->tins[i].deficit = q->tins[i].quantum;
 
 	err = tcf_block_get(&q->block, &q->filter_list, sch, extack);
 	if (err)
 		goto init_failure;
 
 	if (!q->flows) {
-		q->flows = kvcalloc(q->flows_cnt,
-				    sizeof(struct fq_codel_flow),
-				    GFP_KERNEL);
-		if (!q->flows) {
-			err = -ENOMEM;
+		if ((q->exhaust_policy == FQ_CODEL_EXHAUST_OVERFLOW ||
+		     q->new_flow_rate) &&
+		    !q->overflow_cnt && q->flows_cnt > 1)
+			q->overflow_cnt = max_t(u32, 1, q->flows_cnt >>
+						FQ_CODEL_OVERFLOW_SHIFT);
+		if (!q->index_slots)
+			q->index_slots = max_t(u32, FQ_CODEL_INDEX_LOAD * q->flows_cnt,
+					       FQ_CODEL_INDEX_MIN_SLOTS);
+		q->index_seed[0] = get_random_u32();
+		q->index_seed[1] = get_random_u32();
+		q->classid_seed = get_random_u32();
+		err = fq_codel_arena_alloc(q);
+		if (err)
 			goto init_failure;
-		}
-		q->backlogs = kvcalloc(q->flows_cnt, sizeof(u32), GFP_KERNEL);
-		if (!q->backlogs) {
-			err = -ENOMEM;
-			goto alloc_failure;
-		}
-		// $$
-		/*
-		 * Allocation of memory for the hashtable
-		 */
-        q->hashtable = kvcalloc(2*q->flows_cnt, sizeof(u16), GFP_KERNEL);
-        if (!q->hashtable) {
-            err = -ENOMEM;
-            goto alloc_failure;
-        }
-
-		// $$
-		/*
-		 * Allocation of memory for the random_seed
-		 */
-        q->random_seed = kvcalloc(2, sizeof(32), GFP_KERNEL);
-        if (!q->random_seed) {
-            err = -ENOMEM;
-            goto alloc_failure;
-        }
-		q->random_seed[0] = get_random_u32();
-		q->random_seed[1] = get_random_u32();
+		bitmap_fill(q->empty_flow_mask, q->flows_cnt);
 		for (i = 0; i < q->flows_cnt; i++) {
 			struct fq_codel_flow *flow = q->flows + i;
 
 			INIT_LIST_HEAD(&flow->flowchain);
+			RB_CLEAR_NODE(&flow->rate_node);
 			codel_vars_init(&flow->cvars);
+			flow->weight = 1;
 		}
 	}
-	if (sch->limit >= 1)
-		sch->flags |= TCQ_F_CAN_BYPASS;
-	else
-		sch->flags &= ~TCQ_F_CAN_BYPASS;
+	fq_codel_update_bypass(sch);
 	return 0;
 
-alloc_failure:
-	kvfree(q->flows);
-	q->flows = NULL;
 init_failure:
 	q->flows_cnt = 0;
 	return err;
@@ -697,12 +2921,52 @@ static int fq_codel_dump(struct Qdisc *sch, struct sk_buff *skb)
 			q->cparams.ecn) ||
 	    nla_put_u32(skb, TCA_FQ_CODEL_QUANTUM,
 			q->quantum) ||
+	    nla_put_u32(skb, TCA_FQ_CODEL_QUANTUM_AUTO,
+			q->quantum_auto) ||
 	    nla_put_u32(skb, TCA_FQ_CODEL_DROP_BATCH_SIZE,
 			q->drop_batch_size) ||
 	    nla_put_u32(skb, TCA_FQ_CODEL_MEMORY_LIMIT,
 			q->memory_limit) ||
 	    nla_put_u32(skb, TCA_FQ_CODEL_FLOWS,
-			q->flows_cnt))
+			q->flows_cnt) ||
+	    nla_put_u32(skb, TCA_FQ_CODEL_DIFFSERV,
+			q->tin_cnt) ||
+	    nla_put_u32(skb, TCA_FQ_CODEL_INDEX,
+			q->index_type) ||
+	    nla_put_u32(skb, TCA_FQ_CODEL_INDEX_SLOTS,
+			q->index_slots) ||
+	    nla_put_u32(skb, TCA_FQ_CODEL_EXHAUST_POLICY,
+			q->exhaust_policy) ||
+	    nla_put_u32(skb, TCA_FQ_CODEL_OVERFLOW_FLOWS,
+			q->overflow_cnt) ||
+	    nla_put_u32(skb, TCA_FQ_CODEL_NEW_FLOW_RATE,
+			q->new_flow_rate) ||
+	    nla_put_u32(skb, TCA_FQ_CODEL_NEW_FLOW_BURST,
+			q->new_flow_burst) ||
+	    nla_put_u32(skb, TCA_FQ_CODEL_CLASSID_INDEX,
+			q->classid_index) ||
+	    nla_put_u32(skb, TCA_FQ_CODEL_WEIGHTS,
+			q->weights) ||
+	    nla_put_u32(skb, TCA_FQ_CODEL_DROP_POLICY,
+			q->drop_policy) ||
+	    nla_put_u32(skb, TCA_FQ_CODEL_BLOOM,
+			codel_time_to_us(q->bloom_period)) ||
+	    nla_put_u32(skb, TCA_FQ_CODEL_BLUE,
+			q->blue) ||
+	    nla_put_u32(skb, TCA_FQ_CODEL_ACK_FILTER,
+			q->ack_filter) ||
+	    nla_put_u32(skb, TCA_FQ_CODEL_PACING,
+			q->pacing) ||
+	    nla_put_u32(skb, TCA_FQ_CODEL_FLOW_BACKLOG_LIMIT,
+			q->flow_backlog_limit) ||
+	    nla_put_u32(skb, TCA_FQ_CODEL_FLOW_MEMORY_LIMIT,
+			q->flow_memory_limit) ||
+	    nla_put_s32(skb, TCA_FQ_CODEL_OVERHEAD,
+			q->shaper_overhead) ||
+	    nla_put_u64_64bit(skb, TCA_FQ_CODEL_RATE,
+			      q->shaper_rate, TCA_FQ_CODEL_CUCKOO_PAD) ||
+	    nla_put_u64_64bit(skb, TCA_FQ_CODEL_SPLIT_GSO_RATE,
+			      q->split_gso_rate, TCA_FQ_CODEL_CUCKOO_PAD))
 		goto nla_put_failure;
 
 	if (q->cparams.ce_threshold != CODEL_DISABLED_THRESHOLD &&
@@ -710,6 +2974,11 @@ static int fq_codel_dump(struct Qdisc *sch, struct sk_buff *skb)
 			codel_time_to_us(q->cparams.ce_threshold)))
 		goto nla_put_failure;
 
+	if (q->l4s_threshold != CODEL_DISABLED_THRESHOLD &&
+	    nla_put_u32(skb, TCA_FQ_CODEL_L4S_THRESHOLD,
+			codel_time_to_us(q->l4s_threshold)))
+		goto nla_put_failure;
+
 	return nla_nest_end(skb, opts);
 
 nla_put_failure:
@@ -719,25 +2988,52 @@ nla_put_failure:
 static int fq_codel_dump_stats(struct Qdisc *sch, struct gnet_dump *d)
 {
 	struct fq_codel_sched_data *q = qdisc_priv(sch);
-	struct tc_fq_codel_xstats st = {
-		.type				= TCA_FQ_CODEL_XSTATS_QDISC,
+	struct fq_codel_cuckoo_xstats st = {
+		.fq_codel.type			= TCA_FQ_CODEL_XSTATS_QDISC,
 	};
+	struct fq_codel_index_stats ist = {};
 	struct list_head *pos;
+	int i;
 
-	st.qdisc_stats.maxpacket = q->cstats.maxpacket;
-	st.qdisc_stats.drop_overlimit = q->drop_overlimit;
-	st.qdisc_stats.ecn_mark = q->cstats.ecn_mark;
-	st.qdisc_stats.new_flow_count = q->new_flow_count;
-	st.qdisc_stats.ce_mark = q->cstats.ce_mark;
-	st.qdisc_stats.memory_usage  = q->memory_usage;
-	st.qdisc_stats.drop_overmemory = q->drop_overmemory;
+	st.fq_codel.qdisc_stats.maxpacket = q->cstats.maxpacket;
+	st.fq_codel.qdisc_stats.drop_overlimit = q->drop_overlimit;
+	st.fq_codel.qdisc_stats.ecn_mark = q->cstats.ecn_mark;
+	st.fq_codel.qdisc_stats.new_flow_count = q->new_flow_count;
+	st.fq_codel.qdisc_stats.ce_mark = q->cstats.ce_mark;
+	st.fq_codel.qdisc_stats.memory_usage  = q->memory_usage;
+	st.fq_codel.qdisc_stats.drop_overmemory = q->drop_overmemory;
+	st.drop_blue = q->drop_blue;
+	st.l4s_packets = q->l4s_packets;
+	st.l4s_ce_mark = q->l4s_ce_mark;
+	st.classic_packets = q->classic_packets;
+	st.gso_split = q->gso_split;
+	st.ack_drops = q->ack_drops;
+	st.drop_flow_limit = q->drop_flow_limit;
+	st.throttled_flows = q->throttled_flows;
+	st.flows_throttled = q->flows_throttled;
+	st.link_rate = q->link_rate;
 
 	sch_tree_lock(sch);
-	list_for_each(pos, &q->new_flows)
-		st.qdisc_stats.new_flows_len++;
-
-	list_for_each(pos, &q->old_flows)
-		st.qdisc_stats.old_flows_len++;
+	q->index_ops->stats(q, &ist);
+	st.index = q->index_type;
+	st.index_slots = ist.slots;
+	st.index_mapped = q->index_mapped;
+	st.index_moves = q->index_moves;
+	st.index_failures = q->index_failures;
+	st.exhaust_share = q->exhaust_share;
+	st.exhaust_evict = q->exhaust_evict;
+	st.exhaust_overflow = q->exhaust_overflow;
+	st.exhaust_hashed = q->exhaust_hashed;
+	st.new_flow_throttled = q->new_flow_throttled;
+	st.bloom_denied = q->bloom_denied;
+	for (i = 0; i < q->tin_cnt; i++) {
+		st.tin_packets[i] = q->tins[i].packets;
+		list_for_each(pos, &q->tins[i].new_flows)
+			st.fq_codel.qdisc_stats.new_flows_len++;
+
+		list_for_each(pos, &q->tins[i].old_flows)
+			st.fq_codel.qdisc_stats.old_flows_len++;
+	}
 	sch_tree_unlock(sch);
 
 	return gnet_stats_copy_app(d, &st, sizeof(st));
@@ -786,28 +3082,33 @@ static int fq_codel_dump_class_stats(struct Qdisc *sch, unsigned long cl,
 	struct fq_codel_sched_data *q = qdisc_priv(sch);
 	u32 idx = cl - 1;
 	struct gnet_stats_queue qs = { 0 };
-	struct tc_fq_codel_xstats xstats;
+	struct fq_codel_cuckoo_cl_xstats xstats;
 
 	if (idx < q->flows_cnt) {
 		const struct fq_codel_flow *flow = &q->flows[idx];
+		struct tc_fq_codel_cl_stats *cls;
 		const struct sk_buff *skb;
 
 		memset(&xstats, 0, sizeof(xstats));
-		xstats.type = TCA_FQ_CODEL_XSTATS_CLASS;
-		xstats.class_stats.deficit = flow->deficit;
-		xstats.class_stats.ldelay =
-			codel_time_to_us(flow->cvars.ldelay);
-		xstats.class_stats.count = flow->cvars.count;
-		xstats.class_stats.lastcount = flow->cvars.lastcount;
-		xstats.class_stats.dropping = flow->cvars.dropping;
+		cls = &xstats.fq_codel.class_stats;
+		xstats.fq_codel.type = TCA_FQ_CODEL_XSTATS_CLASS;
+		cls->deficit = flow->deficit;
+		cls->ldelay = codel_time_to_us(flow->cvars.ldelay);
+		cls->count = flow->cvars.count;
+		cls->lastcount = flow->cvars.lastcount;
+		cls->dropping = flow->cvars.dropping;
 		if (flow->cvars.dropping) {
 			codel_tdiff_t delta = flow->cvars.drop_next -
 					      codel_get_time();
 
-			xstats.class_stats.drop_next = (delta >= 0) ?
+			cls->drop_next = (delta >= 0) ?
 				codel_time_to_us(delta) :
 				-codel_time_to_us(-delta);
 		}
+		xstats.rate_bps = flow->rate_bps;
+		xstats.rate_pps = flow->rate_pps;
+		xstats.weight = flow->weight;
+		xstats.tin = flow->tin;
 		if (flow->head) {
 			sch_tree_lock(sch);
 			skb = flow->head;
@@ -835,8 +3136,10 @@ static void fq_codel_walk(struct Qdisc *sch, struct qdisc_walker *arg)
 	if (arg->stop)
 		return;
 
-	for (i = 0; i < q->flows_cnt; i++) {
-		if (list_empty(&q->flows[i].flowchain) ||
+	/* flows past the 16 bit class minor cannot be dumped as classes */
+	for (i = 0; i < min_t(u32, q->flows_cnt, TC_H_MIN_MASK); i++) {
+		if ((list_empty(&q->flows[i].flowchain) &&
+		     !fq_codel_flow_is_throttled(&q->flows[i])) ||
 		    arg->count < arg->skip) {
 			arg->count++;
 			continue;
@@ -0,0 +1,251 @@
+/*
+ * Validation of the cuckoo flow index: the SWAR tag match, kick chains and
+ * their rollback when an insert fails.
+ *
+ * The backend below is copied from net/sched/sch_fq_codel_cuckoo_naive.c,
+ * keep it in sync.
+ *
+ * Build and run: gcc -O2 -Wall -o cuckoo cuckoo_validation.c && ./cuckoo
+ */
+#include "index_validation.h"
+
+/* Cuckoo buckets: 8 slots whose 8 bit tags fill a u64 */
+#define FQ_CODEL_CUCKOO_WAYS		8
+#define FQ_CODEL_CUCKOO_ONES		0x0101010101010101ULL
+#define FQ_CODEL_CUCKOO_MAX_KICKS	32
+
+/*
+ * Cuckoo: every key has two candidate buckets of FQ_CODEL_CUCKOO_WAYS slots.
+ * Next to q->index, q->index_tags keeps an 8 bit tag of each slot's key
+ * (0: free), so a bucket's tags are one 64 bit word: a probe compares them
+ * all at once with a SWAR zero byte test and only dereferences flows whose
+ * tag matched. An insert that finds both buckets full displaces occupants
+ * to their other bucket, up to FQ_CODEL_CUCKOO_MAX_KICKS times; a failed
+ * chain is rolled back.
+ */
+static u32 fq_codel_cuckoo_bucket(const struct fq_codel_sched_data *q,
+				  u32 hash, int table)
+{
+	return fq_codel_index_slot(q, hash, table);
+}
+
+static u8 fq_codel_cuckoo_tag(u32 hash)
+{
+	return (hash >> 24) ?: 1;
+}
+
+/* One bit (0x80 of the byte) per slot of bucket whose tag may be tag.
+ * Bytes above a real match can be false positives, the lowest one never.
+ */
+static u64 fq_codel_cuckoo_match(const struct fq_codel_sched_data *q,
+				 u32 bucket, u8 tag)
+{
+	const __le64 *tags = (const __le64 *)q->index_tags + bucket;
+	u64 x = le64_to_cpup(tags) ^ (FQ_CODEL_CUCKOO_ONES * tag);
+
+	return (x - FQ_CODEL_CUCKOO_ONES) & ~x & (FQ_CODEL_CUCKOO_ONES << 7);
+}
+
+static unsigned int fq_codel_cuckoo_lookup(struct fq_codel_sched_data *q,
+					   u32 hash)
+{
+	u8 tag = fq_codel_cuckoo_tag(hash);
+	int table;
+
+	for (table = 0; table < 2; table++) {
+		u32 bucket = fq_codel_cuckoo_bucket(q, hash, table);
+		u64 match = fq_codel_cuckoo_match(q, bucket, tag);
+
+		while (match) {
+			u32 slot = bucket * FQ_CODEL_CUCKOO_WAYS +
+				   (__ffs64(match) >> 3);
+			u32 entry = fq_codel_index_get(q, slot);
+
+			if (entry && fq_codel_entry_hash(q, entry) == hash)
+				return entry;
+			match &= match - 1;
+		}
+	}
+	return 0;
+}
+
+/* Store entry in a free slot of bucket, if it has one */
+static bool fq_codel_cuckoo_place(struct fq_codel_sched_data *q, u32 bucket,
+				  u32 entry, u8 tag)
+{
+	u64 match = fq_codel_cuckoo_match(q, bucket, 0);
+	u32 slot;
+
+	if (!match)
+		return false;
+	slot = bucket * FQ_CODEL_CUCKOO_WAYS + (__ffs64(match) >> 3);
+	fq_codel_index_set(q, slot, entry);
+	q->index_tags[slot] = tag;
+	return true;
+}
+
+static bool fq_codel_cuckoo_insert(struct fq_codel_sched_data *q,
+				   unsigned int idx)
+{
+	u32 path[FQ_CODEL_CUCKOO_MAX_KICKS];
+	u32 hash = q->flows[idx].hash, entry = idx + 1, bucket, alt;
+	u8 tag = fq_codel_cuckoo_tag(hash);
+	int kicks;
+
+	bucket = fq_codel_cuckoo_bucket(q, hash, 0);
+	if (fq_codel_cuckoo_place(q, bucket, entry, tag) ||
+	    fq_codel_cuckoo_place(q, fq_codel_cuckoo_bucket(q, hash, 1),
+				  entry, tag))
+		return true;
+
+	for (kicks = 0; kicks < FQ_CODEL_CUCKOO_MAX_KICKS; kicks++) {
+		u32 slot = bucket * FQ_CODEL_CUCKOO_WAYS +
+			   ((hash + kicks) & (FQ_CODEL_CUCKOO_WAYS - 1));
+
+		entry = fq_codel_index_xchg(q, slot, entry);
+		swap(tag, q->index_tags[slot]);
+		path[kicks] = slot;
+		q->index_moves++;
+
+		hash = fq_codel_entry_hash(q, entry);
+		alt = fq_codel_cuckoo_bucket(q, hash, 0);
+		if (alt == bucket)
+			alt = fq_codel_cuckoo_bucket(q, hash, 1);
+		if (fq_codel_cuckoo_place(q, alt, entry, tag))
+			return true;
+		bucket = alt;
+	}
+	while (kicks--) {
+		entry = fq_codel_index_xchg(q, path[kicks], entry);
+		swap(tag, q->index_tags[path[kicks]]);
+	}
+	return false;
+}
+
+static unsigned int fq_codel_cuckoo_candidates(struct fq_codel_sched_data *q,
+					       u32 hash, u32 *cand)
+{
+	unsigned int n = 0;
+	int table, way;
+
+	for (table = 0; table < 2; table++) {
+		u32 slot = fq_codel_cuckoo_bucket(q, hash, table) *
+			   FQ_CODEL_CUCKOO_WAYS;
+
+		for (way = 0; way < FQ_CODEL_CUCKOO_WAYS; way++, slot++) {
+			if (fq_codel_index_get(q, slot))
+				cand[n++] = fq_codel_index_get(q, slot);
+		}
+	}
+	return n;
+}
+
+static void fq_codel_cuckoo_remove(struct fq_codel_sched_data *q,
+				   unsigned int idx)
+{
+	u32 hash = q->flows[idx].hash;
+	u8 tag = fq_codel_cuckoo_tag(hash);
+	int table;
+
+	for (table = 0; table < 2; table++) {
+		u32 bucket = fq_codel_cuckoo_bucket(q, hash, table);
+		u64 match = fq_codel_cuckoo_match(q, bucket, tag);
+
+		while (match) {
+			u32 slot = bucket * FQ_CODEL_CUCKOO_WAYS +
+				   (__ffs64(match) >> 3);
+
+			if (fq_codel_index_get(q, slot) == idx + 1) {
+				fq_codel_index_set(q, slot, 0);
+				q->index_tags[slot] = 0;
+				return;
+			}
+			match &= match - 1;
+		}
+	}
+}
+
+/* The slot carries its key's tag and sits in one of the key's buckets, and
+ * the SWAR match of that bucket reports it.
+ */
+static const char *cuckoo_check(struct fq_codel_sched_data *q, u32 slot)
+{
+	u32 hash = fq_codel_entry_hash(q, fq_codel_index_get(q, slot));
+	u8 tag = fq_codel_cuckoo_tag(hash);
+	u32 bucket = slot / FQ_CODEL_CUCKOO_WAYS;
+	u64 match;
+
+	if (q->index_tags[slot] != tag)
+		return "tag does not match the key";
+	if (bucket != fq_codel_cuckoo_bucket(q, hash, 0) &&
+	    bucket != fq_codel_cuckoo_bucket(q, hash, 1))
+		return "key outside both of its buckets";
+	match = fq_codel_cuckoo_match(q, bucket, tag);
+	if (!(match & (0x80ULL << (slot % FQ_CODEL_CUCKOO_WAYS * 8))))
+		return "SWAR match misses the slot";
+	return NULL;
+}
+
+/* A bucket of tags against a byte by byte comparison: the lowest reported
+ * byte is always a real match, and no real match goes unreported.
+ */
+static int cuckoo_match_check(void)
+{
+	struct fq_codel_sched_data q = {};
+	u8 tags[FQ_CODEL_CUCKOO_WAYS];
+	u32 rand = 88172645, i, way;
+	int failures = 0;
+
+	q.index_tags = tags;
+	for (i = 0; i < 1000000; i++) {
+		u8 tag = i & 0xff;
+		u64 match, lowest;
+
+		for (way = 0; way < FQ_CODEL_CUCKOO_WAYS; way++) {
+			rand ^= rand << 13;
+			rand ^= rand >> 17;
+			rand ^= rand << 5;
+			/* favour the byte values around the one looked for */
+			if (rand & 1)
+				tags[way] = tag + (rand >> 8) % 3 - 1;
+			else
+				tags[way] = rand >> 8;
+		}
+		match = fq_codel_cuckoo_match(&q, 0, tag);
+		for (way = 0; way < FQ_CODEL_CUCKOO_WAYS; way++) {
+			if (tags[way] == tag &&
+			    !(match & (0x80ULL << (way * 8)))) {
+				failures++;
+				break;
+			}
+		}
+		if (match) {
+			lowest = __ffs64(match) >> 3;
+			if (tags[lowest] != tag)
+				failures++;
+		}
+	}
+	printf("%s cuckoo/match: %d failures\n", failures ? "FAIL" : "PASS",
+	       failures);
+	return failures;
+}
+
+static const struct fq_codel_index_ops cuckoo_ops = {
+	.name		= "cuckoo",
+	.slot_align	= FQ_CODEL_CUCKOO_WAYS,
+	.tags		= true,
+	.rollback	= true,
+	.lookup		= fq_codel_cuckoo_lookup,
+	.insert		= fq_codel_cuckoo_insert,
+	.remove		= fq_codel_cuckoo_remove,
+	.candidates	= fq_codel_cuckoo_candidates,
+	.check		= cuckoo_check,
+};
+
+int main(void)
+{
+	int failures = cuckoo_match_check();
+
+	/* twice as many flows as slots: kick chains run out and roll back */
+	return index_validate(&cuckoo_ops, 4, true) || failures;
+}
@@ -0,0 +1,164 @@
+/*
+ * Validation of the hopscotch flow index: neighbourhood bitmaps, hopping a
+ * free slot back towards home, and neighbourhoods that wrap around the end
+ * of the table.
+ *
+ * The backend below is copied from net/sched/sch_fq_codel_cuckoo_naive.c,
+ * keep it in sync.
+ *
+ * Build and run:
+ *	gcc -O2 -Wall -o hopscotch hopscotch_validation.c && ./hopscotch
+ */
+#include "index_validation.h"
+
+/*
+ * Hopscotch: a key lives within FQ_CODEL_HOP_RANGE slots of its home slot,
+ * whose index_aux bitmap tells which of them hold its keys. An insert
+ * probes linearly for a free slot and hops it back towards home by moving
+ * keys that stay inside their own neighbourhood.
+ */
+#define FQ_CODEL_HOP_RANGE	32
+#define FQ_CODEL_HOP_PROBE	512
+
+static unsigned int fq_codel_hopscotch_lookup(struct fq_codel_sched_data *q,
+					      u32 hash)
+{
+	u32 home = fq_codel_index_slot(q, hash, 0);
+	unsigned long hop = q->index_aux[home];
+	unsigned int bit;
+
+	for_each_set_bit(bit, &hop, FQ_CODEL_HOP_RANGE) {
+		u32 slot = fq_codel_index_wrap(q, home + bit);
+		u32 entry = fq_codel_index_get(q, slot);
+
+		if (entry && fq_codel_entry_hash(q, entry) == hash)
+			return entry;
+	}
+	return 0;
+}
+
+static bool fq_codel_hopscotch_insert(struct fq_codel_sched_data *q,
+				      unsigned int idx)
+{
+	u32 home = fq_codel_index_slot(q, q->flows[idx].hash, 0);
+	u32 probe = min_t(u32, FQ_CODEL_HOP_PROBE, q->index_slots);
+	u32 free = home, dist;
+
+	for (dist = 0; dist < probe; dist++) {
+		if (!fq_codel_index_get(q, free))
+			break;
+		free = fq_codel_index_next(q, free);
+	}
+	if (dist == probe)
+		return false;
+
+	while (dist >= FQ_CODEL_HOP_RANGE) {
+		u32 off, bucket = fq_codel_index_wrap(q, free + q->index_slots -
+						      (FQ_CODEL_HOP_RANGE - 1));
+		bool moved = false;
+
+		/* the furthest bucket first: it can hop the longest way */
+		for (off = FQ_CODEL_HOP_RANGE - 1; off > 0 && !moved; off--) {
+			unsigned long hop = q->index_aux[bucket];
+			unsigned int bit = find_first_bit(&hop, off);
+
+			if (bit < off) {
+				u32 from = fq_codel_index_wrap(q, bucket + bit);
+
+				fq_codel_index_set(q, free, fq_codel_index_get(q, from));
+				fq_codel_index_set(q, from, 0);
+				q->index_aux[bucket] &= ~(1U << bit);
+				q->index_aux[bucket] |= 1U << off;
+				q->index_moves++;
+				dist -= fq_codel_index_distance(q, from, free);
+				free = from;
+				moved = true;
+			}
+			bucket = fq_codel_index_next(q, bucket);
+		}
+		if (!moved)
+			return false;
+	}
+	fq_codel_index_set(q, free, idx + 1);
+	q->index_aux[home] |= 1U << dist;
+	return true;
+}
+
+static unsigned int fq_codel_hopscotch_candidates(struct fq_codel_sched_data *q,
+						  u32 hash, u32 *cand)
+{
+	u32 slot = fq_codel_index_slot(q, hash, 0);
+	unsigned int n = 0;
+	int i;
+
+	for (i = 0; i < FQ_CODEL_HOP_RANGE; i++) {
+		if (fq_codel_index_get(q, slot))
+			cand[n++] = fq_codel_index_get(q, slot);
+		slot = fq_codel_index_next(q, slot);
+	}
+	return n;
+}
+
+static void fq_codel_hopscotch_remove(struct fq_codel_sched_data *q,
+				      unsigned int idx)
+{
+	u32 home = fq_codel_index_slot(q, q->flows[idx].hash, 0);
+	unsigned long hop = q->index_aux[home];
+	unsigned int bit;
+
+	for_each_set_bit(bit, &hop, FQ_CODEL_HOP_RANGE) {
+		u32 slot = fq_codel_index_wrap(q, home + bit);
+
+		if (fq_codel_index_get(q, slot) == idx + 1) {
+			fq_codel_index_set(q, slot, 0);
+			q->index_aux[home] &= ~(1U << bit);
+			return;
+		}
+	}
+}
+
+/* The key is within FQ_CODEL_HOP_RANGE of its home, whose bitmap has the
+ * bit of that distance set, and every bit set belongs to a key of that home.
+ */
+static const char *hopscotch_check(struct fq_codel_sched_data *q, u32 slot)
+{
+	u32 hash = fq_codel_entry_hash(q, fq_codel_index_get(q, slot));
+	u32 home = fq_codel_index_slot(q, hash, 0);
+	u32 dist = fq_codel_index_distance(q, home, slot);
+	unsigned int bit;
+
+	if (dist >= FQ_CODEL_HOP_RANGE)
+		return "key outside its neighbourhood";
+	if (!(q->index_aux[home] & (1U << dist)))
+		return "home bitmap misses the key";
+	for (bit = 0; bit < FQ_CODEL_HOP_RANGE; bit++) {
+		u32 entry;
+
+		if (!(q->index_aux[slot] & (1U << bit)))
+			continue;
+		entry = fq_codel_index_get(q, fq_codel_index_wrap(q, slot + bit));
+		if (!entry)
+			return "bitmap bit on a free slot";
+		hash = fq_codel_entry_hash(q, entry);
+		if (fq_codel_index_slot(q, hash, 0) != slot)
+			return "bitmap bit on a key of another home";
+	}
+	return NULL;
+}
+
+static const struct fq_codel_index_ops hopscotch_ops = {
+	.name		= "hopscotch",
+	.slot_align	= 1,
+	.aux		= true,
+	.lookup		= fq_codel_hopscotch_lookup,
+	.insert		= fq_codel_hopscotch_insert,
+	.remove		= fq_codel_hopscotch_remove,
+	.candidates	= fq_codel_hopscotch_candidates,
+	.check		= hopscotch_check,
+};
+
+int main(void)
+{
+	/* twice as many flows as slots: probes and hops run out */
+	return index_validate(&hopscotch_ops, 4, true);
+}
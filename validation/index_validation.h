@@ -0,0 +1,573 @@
+/*
+ * Userspace harness for the flow index backends of
+ * net/sched/sch_fq_codel_cuckoo_naive.c.
+ *
+ * Each *_validation.c program copies one backend (lookup, insert, remove
+ * and candidates) from the qdisc unchanged, includes this file for the
+ * kernel helpers and shared index code it needs, and runs the scenarios
+ * below against a reference set of mapped flows:
+ *  - churn: random inserts and removes, up to as many flows as slots,
+ *    everything checked after each one
+ *  - fill: inserts until the table refuses keys, a failed insert must
+ *    leave every mapped key where a lookup finds it
+ *  - wrap: keys all homed on the last buckets, so probes and shifts go
+ *    around the end of the table
+ * on power of two and other table sizes and on every index entry width.
+ *
+ * Build and run: gcc -O2 -Wall -o cuckoo cuckoo_validation.c && ./cuckoo
+ */
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdbool.h>
+#include<stdint.h>
+
+/* each program uses its own part of the shared index code below */
+#pragma GCC diagnostic ignored "-Wunused-function"
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef uint64_t __le64;
+
+#define U8_MAX		((u8)~0U)
+#define U16_MAX		((u16)~0U)
+#define BITS_PER_LONG	(8 * sizeof(long))
+
+#define swap(a, b) \
+	do { __typeof__(a) __tmp = (a); (a) = (b); (b) = __tmp; } while (0)
+#define min_t(type, x, y)	((type)(x) < (type)(y) ? (type)(x) : (type)(y))
+#define round_down(x, y)	((x) & ~((__typeof__(x))((y) - 1)))
+
+static bool is_power_of_2(unsigned long n)
+{
+	return n != 0 && (n & (n - 1)) == 0;
+}
+
+static unsigned int ilog2(u32 n)
+{
+	return 31 - __builtin_clz(n);
+}
+
+static unsigned long __ffs64(u64 word)
+{
+	return __builtin_ctzll(word);
+}
+
+/* the tags are little endian whatever the host */
+static u64 le64_to_cpup(const __le64 *p)
+{
+	const u8 *b = (const u8 *)p;
+	u64 v = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		v = v << 8 | b[i];
+	return v;
+}
+
+static unsigned long find_next_bit(const unsigned long *addr,
+				   unsigned long size, unsigned long offset)
+{
+	for (; offset < size; offset++) {
+		unsigned long word = addr[offset / BITS_PER_LONG];
+
+		if (word >> (offset % BITS_PER_LONG) & 1)
+			return offset;
+	}
+	return size;
+}
+
+#define find_first_bit(addr, size)	find_next_bit((addr), (size), 0)
+#define for_each_set_bit(bit, addr, size)				\
+	for ((bit) = find_first_bit((addr), (size));			\
+	     (bit) < (size);						\
+	     (bit) = find_next_bit((addr), (size), (bit) + 1))
+
+/* Replication of include/linux/kernel.h and include/linux/jhash.h */
+static u32 reciprocal_scale(u32 val, u32 ep_ro)
+{
+	return (u32)(((u64)val * ep_ro) >> 32);
+}
+
+#define JHASH_INITVAL	0xdeadbeef
+
+static u32 rol32(u32 word, unsigned int shift)
+{
+	return (word << (shift & 31)) | (word >> ((-shift) & 31));
+}
+
+static u32 jhash_1word(u32 a, u32 initval)
+{
+	u32 b, c;
+
+	/* __jhash_nwords(a, 0, 0, initval + JHASH_INITVAL + (1 << 2)) */
+	initval += JHASH_INITVAL + (1 << 2);
+	a += initval;
+	b = initval;
+	c = initval;
+	c ^= b; c -= rol32(b, 14);
+	a ^= c; a -= rol32(c, 11);
+	b ^= a; b -= rol32(a, 25);
+	c ^= b; c -= rol32(b, 16);
+	a ^= c; a -= rol32(c, 4);
+	b ^= a; b -= rol32(a, 14);
+	c ^= b; c -= rol32(b, 24);
+	return c;
+}
+
+/* The static key is a plain flag here: once set, it stays set */
+static bool fq_codel_npow2;
+#define static_branch_unlikely(key)	(*(key))
+
+#define FQ_CODEL_INDEX_CANDIDATES	32
+
+/* Only what the backends read of a flow */
+struct fq_codel_flow {
+	u32	hash;
+};
+
+struct fq_codel_sched_data {
+	struct fq_codel_flow *flows;
+	void	*index;
+	u32	*index_aux;
+	u8	*index_tags;
+	u32	index_slots;
+	u8	index_width;
+	u32	index_range;
+	u8	index_shift;
+	u32	index_seed[2];
+	u32	index_moves;
+	u32	flows_cnt;
+};
+
+struct fq_codel_index_ops {
+	const char	*name;
+	u32		slot_align;
+	bool		aux;
+	bool		tags;
+	/* a failed insert leaves the table exactly as it found it */
+	bool		rollback;
+
+	unsigned int	(*lookup)(struct fq_codel_sched_data *q, u32 hash);
+	bool		(*insert)(struct fq_codel_sched_data *q,
+				  unsigned int idx);
+	void		(*remove)(struct fq_codel_sched_data *q,
+				  unsigned int idx);
+	unsigned int	(*candidates)(struct fq_codel_sched_data *q, u32 hash,
+				      u32 *cand);
+	/* backend invariants of one occupied slot, NULL if it is fine */
+	const char	*(*check)(struct fq_codel_sched_data *q, u32 slot);
+};
+
+/* Shared index code, as in the qdisc */
+static u8 fq_codel_pow2_shift(u32 n)
+{
+	return is_power_of_2(n) ? 32 - ilog2(n) : 0;
+}
+
+static u32 fq_codel_scale(u32 hash, u32 n, u8 shift)
+{
+	if (static_branch_unlikely(&fq_codel_npow2) && !shift)
+		return reciprocal_scale(hash, n);
+	return (u64)hash >> shift;
+}
+
+static u32 fq_codel_index_slot(const struct fq_codel_sched_data *q, u32 hash,
+			       int seed)
+{
+	return fq_codel_scale(jhash_1word(hash, q->index_seed[seed]),
+			      q->index_range, q->index_shift);
+}
+
+static u32 fq_codel_index_wrap(const struct fq_codel_sched_data *q, u32 slot)
+{
+	if (static_branch_unlikely(&fq_codel_npow2) && !q->index_shift)
+		return slot % q->index_slots;
+	return slot & (q->index_slots - 1);
+}
+
+static u32 fq_codel_entry_hash(const struct fq_codel_sched_data *q, u32 entry)
+{
+	return q->flows[entry - 1].hash;
+}
+
+static u32 fq_codel_index_distance(const struct fq_codel_sched_data *q,
+				   u32 from, u32 to)
+{
+	return to >= from ? to - from : to + q->index_slots - from;
+}
+
+static u32 fq_codel_index_next(const struct fq_codel_sched_data *q, u32 slot)
+{
+	return ++slot == q->index_slots ? 0 : slot;
+}
+
+static u8 fq_codel_index_width(u32 flows_cnt)
+{
+	if (flows_cnt <= U8_MAX)
+		return sizeof(u8);
+	if (flows_cnt <= U16_MAX)
+		return sizeof(u16);
+	return sizeof(u32);
+}
+
+static u32 fq_codel_index_get(const struct fq_codel_sched_data *q, u32 slot)
+{
+	switch (q->index_width) {
+	case sizeof(u8):
+		return ((const u8 *)q->index)[slot];
+	case sizeof(u16):
+		return ((const u16 *)q->index)[slot];
+	default:
+		return ((const u32 *)q->index)[slot];
+	}
+}
+
+static void fq_codel_index_set(struct fq_codel_sched_data *q, u32 slot,
+			       u32 entry)
+{
+	switch (q->index_width) {
+	case sizeof(u8):
+		((u8 *)q->index)[slot] = entry;
+		break;
+	case sizeof(u16):
+		((u16 *)q->index)[slot] = entry;
+		break;
+	default:
+		((u32 *)q->index)[slot] = entry;
+	}
+}
+
+static u32 fq_codel_index_xchg(struct fq_codel_sched_data *q, u32 slot,
+			       u32 entry)
+{
+	u32 old = fq_codel_index_get(q, slot);
+
+	fq_codel_index_set(q, slot, entry);
+	return old;
+}
+
+/* The harness: a table plus the reference set of mapped flows */
+struct index_test {
+	const struct fq_codel_index_ops *ops;
+	struct fq_codel_sched_data q;
+	bool	*mapped;	/* reference set [flows_cnt] */
+	u32	nr_mapped;
+	u32	next_key;	/* keys are fmix32 of a counter: all distinct */
+	u32	rand;
+	const char *scenario;
+	int	failures;
+};
+
+static int index_failures;
+
+static u32 index_rand(struct index_test *t)
+{
+	t->rand ^= t->rand << 13;
+	t->rand ^= t->rand >> 17;
+	t->rand ^= t->rand << 5;
+	return t->rand;
+}
+
+/* murmur3 finalizer: a bijection, so distinct counters give distinct keys */
+static u32 index_fmix32(u32 h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+static u32 index_new_key(struct index_test *t)
+{
+	return index_fmix32(t->next_key++);
+}
+
+static void index_fail(struct index_test *t, const char *what, u32 arg)
+{
+	if (t->failures++ < 10)
+		printf("  FAIL %s/%s (%u flows, %u slots): %s (%u)\n",
+		       t->ops->name, t->scenario, t->q.flows_cnt,
+		       t->q.index_slots, what, arg);
+}
+
+/* Size the table as fq_codel_arena_alloc() does */
+static void index_init(struct index_test *t,
+		       const struct fq_codel_index_ops *ops, u32 flows_cnt,
+		       u32 slots, const char *scenario)
+{
+	struct fq_codel_sched_data *q = &t->q;
+
+	memset(t, 0, sizeof(*t));
+	t->ops = ops;
+	t->scenario = scenario;
+	t->rand = 2463534242U ^ flows_cnt ^ slots;
+	t->next_key = slots * 7919;
+
+	q->flows_cnt = flows_cnt;
+	q->index_slots = round_down(slots, ops->slot_align);
+	q->index_range = q->index_slots / ops->slot_align;
+	q->index_shift = fq_codel_pow2_shift(q->index_range);
+	if (!is_power_of_2(q->index_range))
+		fq_codel_npow2 = true;
+	q->index_width = fq_codel_index_width(flows_cnt);
+	q->index_seed[0] = index_rand(t);
+	q->index_seed[1] = index_rand(t);
+
+	q->flows = calloc(flows_cnt, sizeof(*q->flows));
+	q->index = calloc(q->index_slots, q->index_width);
+	q->index_aux = ops->aux ? calloc(q->index_slots, sizeof(u32)) : NULL;
+	q->index_tags = ops->tags ? calloc(q->index_slots, sizeof(u8)) : NULL;
+	t->mapped = calloc(flows_cnt, sizeof(bool));
+	if (!q->flows || !q->index || (ops->aux && !q->index_aux) ||
+	    (ops->tags && !q->index_tags) || !t->mapped) {
+		printf("out of memory\n");
+		exit(2);
+	}
+}
+
+static void index_exit(struct index_test *t)
+{
+	printf("%s %s/%s: %u flows, %u slots, %u mapped, %u moves\n",
+	       t->failures ? "FAIL" : "PASS", t->ops->name, t->scenario,
+	       t->q.flows_cnt, t->q.index_slots, t->nr_mapped,
+	       t->q.index_moves);
+	index_failures += t->failures;
+	free(t->q.flows);
+	free(t->q.index);
+	free(t->q.index_aux);
+	free(t->q.index_tags);
+	free(t->mapped);
+}
+
+/* Every mapped flow sits in exactly one slot, nothing else does, and the
+ * backend's own invariants hold.
+ */
+static void index_check_table(struct index_test *t)
+{
+	struct fq_codel_sched_data *q = &t->q;
+	u32 *seen = calloc(q->flows_cnt, sizeof(u32));
+	u32 slot, idx, used = 0;
+	const char *err;
+
+	for (slot = 0; slot < q->index_slots; slot++) {
+		u32 entry = fq_codel_index_get(q, slot);
+
+		if (!entry) {
+			if (q->index_tags && q->index_tags[slot])
+				index_fail(t, "free slot with a tag", slot);
+			continue;
+		}
+		used++;
+		if (entry > q->flows_cnt || !t->mapped[entry - 1]) {
+			index_fail(t, "slot holds an unmapped flow", slot);
+			continue;
+		}
+		seen[entry - 1]++;
+		err = t->ops->check ? t->ops->check(q, slot) : NULL;
+		if (err)
+			index_fail(t, err, slot);
+	}
+	for (idx = 0; idx < q->flows_cnt; idx++) {
+		if (t->mapped[idx] && seen[idx] != 1)
+			index_fail(t, "mapped flow not held once", idx);
+	}
+	if (used != t->nr_mapped)
+		index_fail(t, "occupied slots != mapped flows", used);
+	free(seen);
+}
+
+/* Lookups find every mapped key and no other; candidates only return
+ * occupied entries.
+ */
+static void index_check_lookups(struct index_test *t, u32 absent)
+{
+	struct fq_codel_sched_data *q = &t->q;
+	u32 cand[FQ_CODEL_INDEX_CANDIDATES];
+	u32 idx, i, n, key;
+
+	for (idx = 0; idx < q->flows_cnt; idx++) {
+		if (!t->mapped[idx])
+			continue;
+		if (t->ops->lookup(q, q->flows[idx].hash) != idx + 1)
+			index_fail(t, "mapped key not found", idx);
+	}
+	for (i = 0; i < absent; i++) {
+		key = index_fmix32(t->next_key + 0x40000000U + i);
+		if (t->ops->lookup(q, key))
+			index_fail(t, "absent key found", key);
+		n = t->ops->candidates(q, key, cand);
+		if (n > FQ_CODEL_INDEX_CANDIDATES)
+			index_fail(t, "too many candidates", n);
+		while (n--) {
+			if (!cand[n] || cand[n] > q->flows_cnt ||
+			    !t->mapped[cand[n] - 1])
+				index_fail(t, "candidate not mapped", cand[n]);
+		}
+	}
+}
+
+static void index_check(struct index_test *t)
+{
+	index_check_table(t);
+	index_check_lookups(t, 16);
+}
+
+/* Map flow idx to key as fq_codel_table_lookup_or_insert() does. A failed
+ * insert is checked against a copy of the table taken before it.
+ */
+static bool index_insert(struct index_test *t, u32 idx, u32 key)
+{
+	struct fq_codel_sched_data *q = &t->q;
+	size_t size = (size_t)q->index_slots * q->index_width;
+	void *index = malloc(size), *tags = NULL;
+	bool ok;
+
+	memcpy(index, q->index, size);
+	if (q->index_tags) {
+		tags = malloc(q->index_slots);
+		memcpy(tags, q->index_tags, q->index_slots);
+	}
+
+	q->flows[idx].hash = key;
+	t->mapped[idx] = true;
+	t->nr_mapped++;
+	ok = t->ops->insert(q, idx);
+	if (!ok) {
+		t->mapped[idx] = false;
+		t->nr_mapped--;
+		if (t->ops->rollback &&
+		    (memcmp(index, q->index, size) ||
+		     (tags && memcmp(tags, q->index_tags, q->index_slots))))
+			index_fail(t, "failed insert not rolled back", idx);
+	}
+	free(index);
+	free(tags);
+	return ok;
+}
+
+static void index_remove(struct index_test *t, u32 idx)
+{
+	t->ops->remove(&t->q, idx);
+	t->mapped[idx] = false;
+	t->nr_mapped--;
+}
+
+static u32 index_pick(struct index_test *t, bool mapped)
+{
+	u32 idx = index_rand(t) % t->q.flows_cnt;
+
+	while (t->mapped[idx] != mapped)
+		idx = idx + 1 == t->q.flows_cnt ? 0 : idx + 1;
+	return idx;
+}
+
+/* Random inserts and removes around a target load, checking every step */
+static void index_churn(const struct fq_codel_index_ops *ops, u32 flows_cnt,
+			u32 slots, u32 ops_cnt, u32 check_every)
+{
+	struct index_test t;
+	u32 i;
+
+	index_init(&t, ops, flows_cnt, slots, "churn");
+	for (i = 0; i < ops_cnt; i++) {
+		bool grow = t.nr_mapped < flows_cnt &&
+			    (!t.nr_mapped ||
+			     index_rand(&t) % flows_cnt >= t.nr_mapped / 2);
+
+		if (grow)
+			index_insert(&t, index_pick(&t, false),
+				     index_new_key(&t));
+		else
+			index_remove(&t, index_pick(&t, true));
+		if (i % check_every == 0)
+			index_check(&t);
+	}
+	index_check(&t);
+	index_exit(&t);
+}
+
+/* Insert until every flow is tried: with more flows than the table can
+ * place, inserts fail, and each failure must leave the table intact.
+ * Then empty it again in a random order.
+ */
+static void index_fill(const struct fq_codel_index_ops *ops, u32 flows_cnt,
+		       u32 slots, bool must_fail)
+{
+	struct index_test t;
+	u32 idx, failed = 0;
+
+	index_init(&t, ops, flows_cnt, slots, "fill");
+	for (idx = 0; idx < flows_cnt; idx++) {
+		if (!index_insert(&t, idx, index_new_key(&t)))
+			failed++;
+		if (idx % 64 == 0)
+			index_check(&t);
+	}
+	index_check(&t);
+	if (must_fail && !failed)
+		index_fail(&t, "no insert failed", flows_cnt);
+	while (t.nr_mapped) {
+		index_remove(&t, index_pick(&t, true));
+		if (t.nr_mapped % 64 == 0)
+			index_check(&t);
+	}
+	index_check(&t);
+	index_exit(&t);
+}
+
+/* Keys whose first hash lands on the last four buckets: runs,
+ * neighbourhoods and backward shifts all cross the end of the table.
+ */
+static void index_wrap(const struct fq_codel_index_ops *ops, u32 flows_cnt,
+		       u32 slots, u32 keys)
+{
+	struct index_test t;
+	u32 idx, key;
+
+	index_init(&t, ops, flows_cnt, slots, "wrap");
+	for (idx = 0; idx < keys && idx < flows_cnt; idx++) {
+		do {
+			key = index_new_key(&t);
+		} while (fq_codel_index_slot(&t.q, key, 0) <
+			 t.q.index_range - 4);
+		index_insert(&t, idx, key);
+		index_check(&t);
+	}
+	while (t.nr_mapped) {
+		index_remove(&t, index_pick(&t, true));
+		index_check(&t);
+	}
+	index_exit(&t);
+}
+
+/* The same scenarios for one backend on every table shape */
+static int index_validate(const struct fq_codel_index_ops *ops,
+			  u32 fill_ratio, bool fill_must_fail)
+{
+	/* power of two tables first, before the generic path is enabled */
+	index_churn(ops, 128, 256, 20000, 1);
+	index_churn(ops, 256, 256, 20000, 1);
+	index_churn(ops, 4096, 8192, 50000, 97);
+	index_wrap(ops, 128, 256, 48);
+	index_fill(ops, 256 * fill_ratio / 2, 256, fill_must_fail);
+
+	/* 16 and 32 bit entries */
+	index_churn(ops, 1000, 2000, 20000, 13);
+	index_churn(ops, 70000, 1U << 17, 200000, 49999);
+	index_fill(ops, 70000, 1U << 17, false);
+
+	/* other table sizes: reciprocal_scale() and modulo wrapping */
+	index_churn(ops, 200, 400, 20000, 1);
+	index_churn(ops, 400, 400, 20000, 1);
+	index_wrap(ops, 200, 400, 64);
+	index_fill(ops, 400 * fill_ratio / 2, 400, fill_must_fail);
+
+	if (index_failures)
+		printf("%s: %d failures\n", ops->name, index_failures);
+	return index_failures ? 1 : 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * Validation of the Robin Hood flow index: probe distances, the early stop
+ * of lookups, and the backward shift on removal, also across the end of
+ * the table.
+ *
+ * The backend below is copied from net/sched/sch_fq_codel_cuckoo_naive.c,
+ * keep it in sync.
+ *
+ * Build and run:
+ *	gcc -O2 -Wall -o robin_hood robin_hood_validation.c && ./robin_hood
+ */
+#include "index_validation.h"
+
+/*
+ * Robin Hood: linear probing where an insert takes the slot of any key
+ * sitting closer to its home than the newcomer is (index_aux holds that
+ * distance), which keeps probe lengths even and lets a lookup stop early.
+ * Removal shifts the following run back by one slot.
+ */
+static unsigned int fq_codel_robin_hood_lookup(struct fq_codel_sched_data *q,
+					       u32 hash)
+{
+	u32 slot = fq_codel_index_slot(q, hash, 0);
+	u32 dist;
+
+	for (dist = 0; dist < q->index_slots; dist++) {
+		u32 entry = fq_codel_index_get(q, slot);
+
+		if (!entry || q->index_aux[slot] < dist)
+			break;
+		if (fq_codel_entry_hash(q, entry) == hash)
+			return entry;
+		slot = fq_codel_index_next(q, slot);
+	}
+	return 0;
+}
+
+/* There is always a free slot: at least one flow is in the pool and the
+ * table has at least as many slots as there are flows.
+ */
+static bool fq_codel_robin_hood_insert(struct fq_codel_sched_data *q,
+				       unsigned int idx)
+{
+	u32 slot = fq_codel_index_slot(q, q->flows[idx].hash, 0);
+	u32 entry = idx + 1, dist = 0;
+
+	while (fq_codel_index_get(q, slot)) {
+		if (q->index_aux[slot] < dist) {
+			entry = fq_codel_index_xchg(q, slot, entry);
+			swap(dist, q->index_aux[slot]);
+			q->index_moves++;
+		}
+		slot = fq_codel_index_next(q, slot);
+		dist++;
+	}
+	fq_codel_index_set(q, slot, entry);
+	q->index_aux[slot] = dist;
+	return true;
+}
+
+static unsigned int fq_codel_robin_hood_candidates(struct fq_codel_sched_data *q,
+						   u32 hash, u32 *cand)
+{
+	u32 slot = fq_codel_index_slot(q, hash, 0);
+	unsigned int n = 0;
+
+	while (n < FQ_CODEL_INDEX_CANDIDATES && fq_codel_index_get(q, slot)) {
+		cand[n++] = fq_codel_index_get(q, slot);
+		slot = fq_codel_index_next(q, slot);
+	}
+	return n;
+}
+
+static void fq_codel_robin_hood_remove(struct fq_codel_sched_data *q,
+				       unsigned int idx)
+{
+	u32 slot = fq_codel_index_slot(q, q->flows[idx].hash, 0);
+	u32 next, dist;
+
+	for (dist = 0; fq_codel_index_get(q, slot) != idx + 1; dist++) {
+		if (!fq_codel_index_get(q, slot) || q->index_aux[slot] < dist)
+			return;
+		slot = fq_codel_index_next(q, slot);
+	}
+
+	next = fq_codel_index_next(q, slot);
+	while (fq_codel_index_get(q, next) && q->index_aux[next]) {
+		fq_codel_index_set(q, slot, fq_codel_index_get(q, next));
+		q->index_aux[slot] = q->index_aux[next] - 1;
+		slot = next;
+		next = fq_codel_index_next(q, next);
+	}
+	fq_codel_index_set(q, slot, 0);
+	q->index_aux[slot] = 0;
+}
+
+/* index_aux holds the slot's distance from its key's home, and along a run
+ * distances grow by one at most: a lookup may stop at the first slot
+ * closer to its home than the key it looks for would be.
+ */
+static const char *robin_hood_check(struct fq_codel_sched_data *q, u32 slot)
+{
+	u32 hash = fq_codel_entry_hash(q, fq_codel_index_get(q, slot));
+	u32 home = fq_codel_index_slot(q, hash, 0);
+	u32 next = fq_codel_index_next(q, slot);
+
+	if (q->index_aux[slot] != fq_codel_index_distance(q, home, slot))
+		return "stored distance is not the key's";
+	if (fq_codel_index_get(q, next) &&
+	    q->index_aux[next] > q->index_aux[slot] + 1)
+		return "distance grows by more than one along the run";
+	if (!fq_codel_index_get(q, next) && q->index_aux[next])
+		return "free slot with a distance";
+	return NULL;
+}
+
+static const struct fq_codel_index_ops robin_hood_ops = {
+	.name		= "robin_hood",
+	.slot_align	= 1,
+	.aux		= true,
+	.lookup		= fq_codel_robin_hood_lookup,
+	.insert		= fq_codel_robin_hood_insert,
+	.remove		= fq_codel_robin_hood_remove,
+	.candidates	= fq_codel_robin_hood_candidates,
+	.check		= robin_hood_check,
+};
+
+int main(void)
+{
+	/* never more flows than slots, as fq_codel_init() guarantees */
+	return index_validate(&robin_hood_ops, 2, false);
+}